@@ -1,46 +1,91 @@
+#define _GNU_SOURCE
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "lzw.h"
 
-typedef struct lzw_node_tag *lzw_node_p;
+// The encoder and decoder need different views of the dictionary.
+// The encoder only ever asks "does this prefix extend by this byte?",
+// so it keeps a trie of prefixes. The decoder only ever asks "what is
+// the string for this key?", so it keeps a table indexed by key.
 
+// Encoder-only: a node in the trie of prefixes. Nodes live in one array
+// indexed by their key, so children are just keys too. The root is never
+// anyone's child, so a child key of root means "no child".
 typedef struct lzw_children_set_tag {
   bool use_array;
-  struct {
-    int index;
-    struct {
-      uint8_t key;
-      lzw_node_p value;
-    } immediate[4];
-  } local;
-  lzw_node_p *all;
+  uint16_t index; // how many children we have
+  uint8_t keys[4];
+  union {
+    uint32_t values[4];
+    uint32_t all; // which 256-key block of the trie's blocks is ours
+  };
 } lzw_children_set_t;
 
-// we want to build a mapping from keys to data-strings.
 typedef struct lzw_node_tag {
   lzw_children_set_t children;
-  uint32_t key;
-} lzw_node_t, *lzw_node_p;
+#ifndef NDEBUG
+  uint32_t len; // only used for tracing.
+#endif
+} lzw_node_t;
 
+// Decoder-only: each string is its prefix's key plus one more byte.
+// We never materialize the strings; lzw_write_string walks the chain.
 typedef struct {
-  uint8_t *data;
+  uint32_t prefix;
   uint32_t len;
-  lzw_node_p parent;
+  uint8_t last;
+  uint8_t first;
+  uint16_t children; // only for budgeting
 } lzw_data_t;
 
-lzw_data_t *lzw_data = NULL;
-lzw_node_p root = NULL;
-lzw_node_p curr = NULL;
+const uint32_t lzw_clear_code = 256;
+// The clear-code never names a string, so its node doubles as the root.
+const uint32_t root = 256;
+
+// Sync flushing. With lzw_sync set, key 257 is reserved as a flush code:
+// the decoder skips to the next byte boundary when it reads one, and the
+// dictionary carries on. Both directions must agree on lzw_sync.
+bool lzw_sync = false;
+const uint32_t lzw_flush_code = 257;
+uint32_t lzw_flush_timeout_ms = 0;
+
+// compress(1) compatibility. With lzw_compress_bits set we read and write
+// .Z streams: a 3-byte header, codes packed LSB-first, widths from 9 bits
+// up to lzw_compress_bits, and 256 as the (block-mode) clear code. When
+// compress changes width, or after a clear, it pads the output out to a
+// whole group of 8 codes; we track where the current group started.
+uint32_t lzw_compress_bits = 0;
+static const uint8_t compress_magic[2] = {0x1f, 0x9d};
+static const uint8_t compress_block_mode = 0x80;
+static uint64_t group_origin = 0;
+
+// The first key past the reserved ones.
+static uint32_t lzw_first_key(void) {
+  return lzw_sync ? lzw_flush_code + 1 : lzw_clear_code + 1;
+}
+
+uint32_t curr = 0;           // encoder
+lzw_data_t *lzw_data = NULL; // decoder
 
 uint32_t lzw_length = 0;
 uint32_t lzw_next_key = 0;
 uint32_t lzw_max_key = 0;
+// lzw_max_key, further limited by any byte budget; see lzw_init_common.
+static uint32_t lzw_key_limit = 0;
 
 FILE *lzw_input_file;
 FILE *lzw_output_file;
@@ -62,11 +107,6 @@ const uint32_t BITWRITE_BUFFER_MAX_SIZE = sizeof(bitwrite_buffer) * 8;
 // Before we get too much into executable code,
 // we want to express the different modes we can run in.
 // I.e., debug levels
-#ifdef NDEBUG
-#define DTRACE(k, ...)
-#define ASSERT(x)
-#define DEBUG_STMT(x)
-#else
 enum {
   DB_STATE,
   DB_BYTE_STREAM,
@@ -74,6 +114,13 @@ enum {
   DB_DICTIONARY,
   DB_MAX,
 };
+// The same categories, as a mask, pick what the binary trace records.
+static unsigned trace_categories = 0;
+#ifdef NDEBUG
+#define DTRACE(k, ...)
+#define ASSERT(x)
+#define DEBUG_STMT(x)
+#else
 int DB_KEYS_SET[DB_MAX] = {};
 #define DTRACE(k, ...)                                                         \
   if (DB_KEYS_SET[k]) {                                                        \
@@ -84,25 +131,98 @@ int DB_KEYS_SET[DB_MAX] = {};
 #endif
 
 void lzw_set_debug_string(const char *s) {
-#ifdef NDEBUG
-#else
   for (int i = 0; i < strlen(s); i++) {
+    int k;
     switch (s[i]) {
     case 's':
-      DB_KEYS_SET[DB_STATE] = 1;
+      k = DB_STATE;
       break;
     case 'b':
-      DB_KEYS_SET[DB_BYTE_STREAM] = 1;
+      k = DB_BYTE_STREAM;
       break;
     case 'k':
-      DB_KEYS_SET[DB_KEY_STREAM] = 1;
+      k = DB_KEY_STREAM;
       break;
     case 'd':
-      DB_KEYS_SET[DB_DICTIONARY] = 1;
+      k = DB_DICTIONARY;
       break;
+    default:
+      continue;
     }
+    trace_categories |= 1u << k;
+    DEBUG_STMT(DB_KEYS_SET[k] = 1;)
   }
-#endif
+}
+
+// The binary trace is always compiled in; it costs a branch when it's off.
+static lzw_trace_header_t *trace_header = NULL;
+static lzw_trace_event_t *trace_events = NULL;
+static uint64_t trace_mask = 0;
+#define TRACE(...)                                                             \
+  if (trace_events) {                                                          \
+    trace_events[trace_header->next++ & trace_mask] =                          \
+        (lzw_trace_event_t){__VA_ARGS__};                                      \
+  }
+#define TRACE_IF(k, ...)                                                       \
+  if (trace_events && trace_categories & 1u << (k)) {                          \
+    TRACE(__VA_ARGS__)                                                         \
+  }
+
+// Release tries don't keep string lengths, so the trace keeps its own.
+static uint32_t *trace_lengths = NULL;
+static uint32_t trace_lengths_size = 0;
+
+static uint32_t trace_length_add(uint32_t k, uint32_t prefix) {
+  if (k >= trace_lengths_size) {
+    trace_lengths_size = k < 512 ? 1024 : 2 * k;
+    trace_lengths =
+        realloc(trace_lengths, trace_lengths_size * sizeof(*trace_lengths));
+  }
+  // Keys below 256 are the single bytes.
+  return trace_lengths[k] = (prefix < 256 ? 1 : trace_lengths[prefix]) + 1;
+}
+
+void lzw_trace_close(void) {
+  if (trace_header) {
+    munmap(trace_header, sizeof(*trace_header) +
+                             (trace_mask + 1) * sizeof(lzw_trace_event_t));
+  }
+  trace_header = NULL;
+  trace_events = NULL;
+  trace_mask = 0;
+  free(trace_lengths);
+  trace_lengths = NULL;
+  trace_lengths_size = 0;
+}
+
+bool lzw_trace_open(const char *path, uint64_t capacity) {
+  lzw_trace_close();
+  uint64_t n = 1;
+  while (n < capacity) {
+    n <<= 1;
+  }
+  const size_t size = sizeof(lzw_trace_header_t) + n * sizeof(lzw_trace_event_t);
+  const int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return false;
+  }
+  void *m = MAP_FAILED;
+  if (ftruncate(fd, size) == 0) {
+    m = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (m == MAP_FAILED) {
+    return false;
+  }
+  trace_header = m;
+  memcpy(trace_header->magic, LZW_TRACE_MAGIC, sizeof(trace_header->magic));
+  trace_header->version = LZW_TRACE_VERSION;
+  trace_header->event_size = sizeof(lzw_trace_event_t);
+  trace_header->capacity = n;
+  trace_header->next = 0;
+  trace_events = (lzw_trace_event_t *)(trace_header + 1);
+  trace_mask = n - 1;
+  return true;
 }
 
 #ifndef NDEBUG
@@ -118,246 +238,1578 @@ static const char *asbits(uint64_t v, uint8_t l) {
 }
 #endif
 
-lzw_node_p children_set_find(lzw_children_set_t *s, uint8_t k) {
+// Dictionary storage. When the key count is bounded we know the final size up
+// front, so we map all of it once and keep it across clear codes; pages
+// are only touched as keys are added. Otherwise (or if the mapping fails)
+// we grow by doubling, like we always have.
+typedef struct {
+  void *base;
+  size_t size; // in bytes
+  bool mapped;
+} lzw_region_t;
+
+// The encoder's trie is a struct (unlike the rest of our state) so that
+// lzw_encode_interleaved can run several at once.
+typedef struct {
+  lzw_region_t node_region, block_region;
+  lzw_node_t *nodes;
+  uint32_t *blocks;
+  uint32_t blocks_used;
+  uint32_t free_block; // blocks freed by eviction, linked through entry 0
+} lzw_trie_t;
+
+enum { NO_BLOCK = UINT32_MAX };
+
+static lzw_trie_t trie;
+static lzw_region_t data_region;
+bool lzw_huge_pages = false;
+
+static void region_release(lzw_region_t *r) {
+  if (r->mapped) {
+    munmap(r->base, r->size);
+  } else {
+    free(r->base);
+  }
+  r->base = NULL;
+  r->size = 0;
+  r->mapped = false;
+}
+
+static bool region_map(lzw_region_t *r, size_t size) {
+  void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  if (lzw_huge_pages) {
+    // No MAP_NORESERVE: we want to fail here, not fault later, if the
+    // huge page pool is too small.
+    const size_t huge_page_size = 2 << 20;
+    size = (size + huge_page_size - 1) & ~(huge_page_size - 1);
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  }
+#endif
+  if (p == MAP_FAILED) {
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+      return false;
+    }
+#ifdef MADV_HUGEPAGE
+    if (lzw_huge_pages) {
+      madvise(p, size, MADV_HUGEPAGE);
+    }
+#endif
+  }
+  r->base = p;
+  r->size = size;
+  r->mapped = true;
+  return true;
+}
+
+static void region_grow(lzw_region_t *r, size_t size) {
+  ASSERT(!r->mapped);
+  r->base = realloc(r->base, size);
+  r->size = size;
+}
+
+// Called from the inits: make sure r can hold at least the initial
+// dictionary (and, if we're bounded, the final one).
+static void *region_prepare(lzw_region_t *r, size_t initial, size_t final) {
+  if (lzw_key_limit) {
+    if (r->mapped && r->size >= final) {
+      return r->base;
+    }
+    region_release(r);
+    if (region_map(r, final)) {
+      return r->base;
+    }
+  } else if (r->mapped) {
+    region_release(r);
+  }
+  if (r->size < initial) {
+    region_grow(r, initial);
+  }
+  return r->base;
+}
+
+// Called before writing element i of size sz.
+static void *region_fit(lzw_region_t *r, size_t i, size_t sz) {
+  if ((i + 1) * sz > r->size) {
+    size_t size = r->size;
+    while ((i + 1) * sz > size) {
+      size *= 2;
+    }
+    region_grow(r, size);
+  }
+  return r->base;
+}
+
+// How many keys (including the clear-code) we can have.
+static size_t lzw_key_capacity(void) {
+  if (lzw_key_limit > lzw_first_key()) {
+    return lzw_key_limit;
+  }
+  return lzw_first_key();
+}
+
+static inline uint32_t trie_find(const lzw_trie_t *t, uint32_t parent,
+                                 uint8_t k) {
+  const lzw_children_set_t *s = &t->nodes[parent].children;
   if (!s->use_array) {
-    int max_index = s->local.index;
+    int max_index = s->index;
     for (int i = 0; i < max_index; i++) {
-      if (s->local.immediate[i].key == k) {
-        return s->local.immediate[i].value;
+      if (s->keys[i] == k) {
+        return s->values[i];
       }
     }
-    return NULL;
+    return root;
   }
-  return s->all[k];
+  return t->blocks[(s->all << 8) | k];
 }
 
-lzw_node_p children_set_allocate(lzw_children_set_t *s, uint8_t c, uint32_t k) {
-  lzw_node_p r = calloc(1, sizeof(lzw_node_t));
-  r->key = k;
+void trie_add(lzw_trie_t *t, uint32_t parent, uint8_t c, uint32_t k) {
+  t->nodes = region_fit(&t->node_region, k, sizeof(lzw_node_t));
+  memset(&t->nodes[k], 0, sizeof(lzw_node_t));
+  DEBUG_STMT(t->nodes[k].len = t->nodes[parent].len + 1;)
+  lzw_children_set_t *s = &t->nodes[parent].children;
   if (!s->use_array) {
-    int n = s->local.index++;
+    int n = s->index++;
     if (n < 4) {
-      s->local.immediate[n].key = c;
-      s->local.immediate[n].value = r;
-      return r;
+      s->keys[n] = c;
+      s->values[n] = k;
+      return;
+    }
+    s->index--;
+    uint32_t b = t->free_block;
+    if (b != NO_BLOCK) {
+      t->free_block = t->blocks[b << 8];
+    } else {
+      b = t->blocks_used++;
+      t->blocks = region_fit(&t->block_region, b, 256 * sizeof(uint32_t));
+    }
+    uint32_t *all = &t->blocks[b << 8];
+    for (int i = 0; i < 256; i++) {
+      all[i] = root;
+    }
+    for (int i = 0; i < n; i++) {
+      all[s->keys[i]] = s->values[i];
     }
     s->use_array = true;
-    s->all = calloc(256, sizeof(lzw_node_p));
+    s->all = b;
+  }
+  s->index++;
+  t->blocks[(s->all << 8) | c] = k;
+}
+
+void trie_init(lzw_trie_t *t) {
+  // We start with just the root's block, but when bounded the
+  // dictionary can't promote more than one node per 5 keys.
+  const size_t keys = lzw_key_capacity();
+  t->nodes = region_prepare(&t->node_region, 512 * sizeof(lzw_node_t),
+                            keys * sizeof(lzw_node_t));
+  t->blocks = region_prepare(&t->block_region, 256 * sizeof(uint32_t),
+                             (1 + keys / 5) * 256 * sizeof(uint32_t));
+  t->blocks_used = 0;
+  t->free_block = NO_BLOCK;
+  memset(&t->nodes[root], 0, sizeof(lzw_node_t));
+  for (uint16_t i = 0; i < 256; ++i) {
+    trie_add(t, root, i, i);
+  }
+}
+
+// Unlink the leaf k, which is parent's child on c, so its key can be
+// reused. A node that drops back to 4 children gives up its block, so
+// (as without eviction) only nodes with 5 or more children have one.
+void trie_remove(lzw_trie_t *t, uint32_t parent, uint8_t c, uint32_t k) {
+  ASSERT(t->nodes[k].children.index == 0);
+  lzw_children_set_t *s = &t->nodes[parent].children;
+  int n = --s->index;
+  if (!s->use_array) {
     for (int i = 0; i < n; i++) {
-      s->all[s->local.immediate[i].key] = s->local.immediate[i].value;
+      if (s->keys[i] == c) {
+        s->keys[i] = s->keys[n];
+        s->values[i] = s->values[n];
+        break;
+      }
     }
+    return;
+  }
+  const uint32_t b = s->all;
+  uint32_t *all = &t->blocks[b << 8];
+  all[c] = root;
+  if (n > 4) {
+    return;
   }
-  s->all[c] = r;
-  return r;
+  int j = 0;
+  for (int i = 0; i < 256; i++) {
+    if (all[i] != root) {
+      s->keys[j] = i;
+      s->values[j] = all[i];
+      j++;
+    }
+  }
+  ASSERT(j == n);
+  s->use_array = false;
+  all[0] = t->free_block;
+  t->free_block = b;
+}
+
+// We keep mapped regions around for the next trie_init; it will
+// replace them if the key limit has grown.
+void trie_destroy(lzw_trie_t *t) {
+  if (!t->node_region.mapped) {
+    region_release(&t->node_region);
+  }
+  if (!t->block_region.mapped) {
+    region_release(&t->block_region);
+  }
+  t->nodes = NULL;
+  t->blocks = NULL;
+  t->blocks_used = 0;
+}
+
+void trie_release(lzw_trie_t *t) {
+  trie_destroy(t);
+  region_release(&t->node_region);
+  region_release(&t->block_region);
+}
+
+// Eviction. When lzw_evict is set and the dictionary is full, rather
+// than freezing we reuse the key of the least-recently-used leaf (a
+// string that isn't the prefix of any other). Both directions keep this
+// bookkeeping and update it at the same points, so they agree on every
+// victim without anything extra in the stream: a key is "used" when it's
+// emitted or read, and a victim is picked just before adding a string.
+typedef struct {
+  uint32_t prev; // LRU list links; root is the list's sentinel,
+  uint32_t next; // with next the coldest and prev the hottest.
+  uint32_t parent;
+  uint16_t children;
+  uint8_t c;
+} lzw_evict_t;
+
+static lzw_region_t evict_region;
+lzw_evict_t *lzw_evict_data = NULL;
+bool lzw_evict = false;
+
+static bool evict_enabled(void) { return lzw_evict && lzw_key_limit; }
+
+static void evict_unlink(uint32_t k) {
+  lzw_evict_data[lzw_evict_data[k].prev].next = lzw_evict_data[k].next;
+  lzw_evict_data[lzw_evict_data[k].next].prev = lzw_evict_data[k].prev;
+}
+
+static void evict_push(uint32_t k) {
+  const uint32_t hottest = lzw_evict_data[root].prev;
+  lzw_evict_data[k].prev = hottest;
+  lzw_evict_data[k].next = root;
+  lzw_evict_data[hottest].next = k;
+  lzw_evict_data[root].prev = k;
+}
+
+static bool evict_listed(uint32_t k) {
+  return k >= lzw_first_key() && lzw_evict_data[k].children == 0;
+}
+
+static void evict_init(void) {
+  if (!evict_enabled()) {
+    return;
+  }
+  const size_t keys = lzw_key_capacity();
+  lzw_evict_data = region_prepare(&evict_region, keys * sizeof(lzw_evict_t),
+                                  keys * sizeof(lzw_evict_t));
+  lzw_evict_data[root].prev = root;
+  lzw_evict_data[root].next = root;
+  for (uint16_t i = 0; i < 256; ++i) {
+    lzw_evict_data[i].children = 0;
+  }
+}
+
+static void evict_touch(uint32_t k) {
+  if (evict_enabled() && evict_listed(k)) {
+    evict_unlink(k);
+    evict_push(k);
+  }
+}
+
+static void evict_added(uint32_t k, uint32_t parent, uint8_t c) {
+  if (!evict_enabled()) {
+    return;
+  }
+  lzw_evict_data[k].parent = parent;
+  lzw_evict_data[k].c = c;
+  lzw_evict_data[k].children = 0;
+  evict_push(k);
+  if (evict_listed(parent)) {
+    evict_unlink(parent);
+  }
+  lzw_evict_data[parent].children++;
+}
+
+// Returns the key to reuse for a new child of prefix, or root if there
+// is none. prefix itself is never a candidate.
+static uint32_t evict_pick(uint32_t prefix) {
+  if (!evict_enabled()) {
+    return root;
+  }
+  uint32_t k = lzw_evict_data[root].next;
+  if (k == prefix) {
+    k = lzw_evict_data[k].next;
+  }
+  if (k == root) {
+    return root;
+  }
+  evict_unlink(k);
+  const uint32_t parent = lzw_evict_data[k].parent;
+  if (--lzw_evict_data[parent].children == 0 && evict_listed(parent)) {
+    evict_push(parent);
+  }
+  DTRACE(DB_DICTIONARY, "DICT\tEVICT\t%u\t%u\n", k, parent);
+  TRACE(.kind = LZW_TRACE_DICT_EVICT, .key = k, .prefix = parent);
+  return k;
+}
+
+// Byte budget. lzw_max_dictionary_bytes caps the dictionary's memory
+// rather than its key count. Both directions have to agree on exactly
+// when it's reached, so we budget the encoder's (larger) footprint: a
+// node per key, plus a block for each node with more than 4 children.
+// Blocks given up under eviction stay resident on the trie's free list,
+// so they still count until they're reused. The decoder can follow all
+// of that from child counts alone. Debug-only node fields aren't
+// counted, so that all builds agree.
+uint64_t lzw_max_dictionary_bytes = 0;
+static uint64_t dictionary_cost = 0;
+static uint32_t free_block_count = 0;
+static bool dictionary_full = false;
+static const uint64_t block_cost = 256 * sizeof(uint32_t);
+
+static uint64_t key_cost(void) {
+  return sizeof(lzw_children_set_t) + (lzw_evict ? sizeof(lzw_evict_t) : 0);
+}
+
+// The root's block and a node for every initial key, reserved ones included.
+static uint64_t initial_cost(void) {
+  return lzw_first_key() * key_cost() + block_cost;
+}
+
+// The budget also bounds the key count, which lets us map it up front.
+static uint32_t lzw_effective_max_key(void) {
+  uint64_t k = lzw_max_key;
+  if (lzw_max_dictionary_bytes) {
+    uint64_t b = lzw_first_key();
+    if (lzw_max_dictionary_bytes > initial_cost()) {
+      b += (lzw_max_dictionary_bytes - initial_cost()) / key_cost();
+    }
+    if (!k || b < k) {
+      k = b;
+    }
+  }
+  if (lzw_compress_bits) {
+    k = 1u << lzw_compress_bits;
+  }
+  return k < UINT32_MAX ? k : UINT32_MAX;
+}
+
+// Can a parent with n children take another, with a new key or a reused one?
+static bool budget_allows(uint32_t n, bool new_key) {
+  if (!lzw_max_dictionary_bytes) {
+    return true;
+  }
+  const bool new_block = n == 4 && free_block_count == 0;
+  const uint64_t cost =
+      (new_key ? key_cost() : 0) + (new_block ? block_cost : 0);
+  return dictionary_cost + cost <= lzw_max_dictionary_bytes;
+}
+
+static bool new_key_allowed(uint32_t n) {
+  if (lzw_key_limit && lzw_next_key >= lzw_key_limit) {
+    return false;
+  }
+  return budget_allows(n, true);
+}
+
+// n is the parent's child count before the add, or after the removal.
+static void budget_child_added(uint32_t n) {
+  if (n == 4) {
+    if (free_block_count) {
+      free_block_count--;
+    } else {
+      dictionary_cost += block_cost;
+    }
+  }
+}
+
+static void budget_child_removed(uint32_t n) {
+  if (n == 4) {
+    free_block_count++;
+  }
+}
+
+bool lzw_dictionary_full(void) { return dictionary_full; }
+
+// Runs. Greedy parsing of a run of byte b only ever walks the trie's
+// chain b, bb, bbb, ..., so we keep each byte's chain as an array of
+// keys and can take a run a whole string at a time. Chains only grow
+// (by their top node getting a child on b), so without eviction the
+// array is always the whole chain. The arrays are ours alone, so the
+// decoder can't follow them in a byte budget; with one we do without.
+// They're still counted in lzw_dictionary_bytes.
+typedef struct {
+  uint32_t *keys; // keys[k - 1] is the string of k b's
+  uint32_t length;
+  uint32_t capacity;
+} lzw_run_t;
+static lzw_run_t runs[256];
+static uint64_t runs_bytes = 0;
+
+static bool runs_enabled(void) {
+  return !evict_enabled() && !lzw_max_dictionary_bytes;
+}
+
+static uint32_t run_length(uint8_t b) {
+  return runs[b].length ? runs[b].length : 1;
+}
+
+static uint32_t run_key(uint8_t b, uint32_t k) {
+  return runs[b].length ? runs[b].keys[k - 1] : b;
+}
+
+static void run_added(uint32_t parent, uint8_t c, uint32_t k) {
+  lzw_run_t *r = &runs[c];
+  if (!runs_enabled() || parent != run_key(c, run_length(c))) {
+    return;
+  }
+  if (r->length + 2 > r->capacity) {
+    runs_bytes += (r->capacity ? r->capacity : 64) * sizeof(uint32_t);
+    r->capacity = r->capacity ? 2 * r->capacity : 64;
+    r->keys = realloc(r->keys, r->capacity * sizeof(uint32_t));
+    assert(r->keys);
+  }
+  if (!r->length) {
+    r->keys[r->length++] = c;
+  }
+  r->keys[r->length++] = k;
+}
+
+static void runs_release(void) {
+  for (int b = 0; b < 256; b++) {
+    free(runs[b].keys);
+    runs[b] = (lzw_run_t){0};
+  }
+  runs_bytes = 0;
 }
 
 enum { NEXT_CHAR_CONTINUE = 0, NEXT_CHAR_MAX = 1, NEXT_CHAR_NEW = 2 };
-const uint32_t lzw_clear_code = 256;
 
-// The primary action of this table is to ingest
+// The primary action of the encoder's trie is to ingest
 // the next byte, and maintain the correct encoding
 // information for the implicit string seen-so-far.
 // That's captured in this function:
 int lzw_next_char(uint8_t c) {
-  lzw_node_p next = children_set_find(&curr->children, c);
-  if (next) {
-    DTRACE(DB_STATE, "APPEND(%#x)\t\tSTATE\t%u\t%u\n", c, curr->key, next->key);
+  uint32_t next = trie_find(&trie, curr, c);
+  if (next != root) {
+    DTRACE(DB_STATE, "APPEND(%#x)\t\tSTATE\t%u\t%u\n", c, curr, next);
+    TRACE_IF(DB_STATE, .kind = LZW_TRACE_STATE, .key = next, .prefix = curr,
+             .c = c);
     curr = next;
     return NEXT_CHAR_CONTINUE;
   }
-  // we have reached the end of the string.
-  if (lzw_max_key && lzw_next_key >= lzw_max_key) {
+  // we have reached the end of the string, and our caller will emit curr.
+  evict_touch(curr);
+  const uint32_t n = trie.nodes[curr].children.index;
+  uint32_t k;
+  if (new_key_allowed(n)) {
+    k = lzw_next_key++;
+    dictionary_cost += key_cost();
+  } else {
+    k = budget_allows(n, false) ? evict_pick(curr) : root;
+    if (k == root) {
+      DTRACE(DB_STATE, "APPEND(%#x)\tMAXKEY\n", c);
+      TRACE(.kind = LZW_TRACE_MAX_KEY, .c = c);
+      dictionary_full = true;
+      return NEXT_CHAR_MAX;
+    }
+    const uint32_t parent = lzw_evict_data[k].parent;
+    trie_remove(&trie, parent, lzw_evict_data[k].c, k);
+    budget_child_removed(trie.nodes[parent].children.index);
+  }
+  // Create the new node. Note curr is NOT updated: we still need to
+  // emit the "old" prefix.
+  budget_child_added(trie.nodes[curr].children.index);
+  trie_add(&trie, curr, c, k);
+  evict_added(k, curr, c);
+  run_added(curr, c, k);
+  DTRACE(DB_DICTIONARY, "DICT\tADD\t%u\t%u\t%u\t%#x\n", k, curr,
+         trie.nodes[k].len, c);
+  TRACE(.kind = LZW_TRACE_DICT_ADD, .key = k, .prefix = curr,
+        .len = trace_length_add(k, curr), .c = c);
+  DTRACE(DB_STATE, "APPEND(%#x)\t\tNEWSTATE %u\n", c, k);
+  TRACE_IF(DB_STATE, .kind = LZW_TRACE_NEW_STATE, .key = k, .c = c);
+  return NEXT_CHAR_NEW;
+}
+
+// The decoder's counterpart comes in two steps, as it needs to know
+// which key the next string will get before it can tell what that
+// string is. First it reserves the key (root if the dictionary is full).
+uint32_t lzw_reserve_key(uint32_t prefix) {
+  const uint32_t n = lzw_data[prefix].children;
+  if (new_key_allowed(n)) {
+    dictionary_cost += key_cost();
+    return lzw_next_key++;
+  }
+  if (!budget_allows(n, false)) {
+    return root;
+  }
+  const uint32_t k = evict_pick(prefix);
+  if (k != root) {
+    budget_child_removed(--lzw_data[lzw_data[k].prefix].children);
+  }
+  return k;
+}
+
+// Then, knowing the whole string, it just records k as the prefix
+// extended by c.
+int lzw_add_string(uint32_t k, uint32_t prefix, uint8_t c) {
+  if (k == root) {
     DTRACE(DB_STATE, "APPEND(%#x)\tMAXKEY\n", c);
+    TRACE(.kind = LZW_TRACE_MAX_KEY, .c = c);
     return NEXT_CHAR_MAX;
   }
-  // Create the new fields for the new node
-  const uint32_t k = lzw_next_key++;
-  next = children_set_allocate(&curr->children, c, k);
-  const uint32_t l = curr->key == -1 ? 0 : lzw_data[curr->key].len;
-  uint8_t *data = calloc(l + 1, sizeof(uint8_t));
-  if (l) {
-    memcpy(data, lzw_data[curr->key].data, l * sizeof(uint8_t));
-  }
-  data[l] = c;
-  lzw_data[k].data = data;
-  lzw_data[k].len = l + 1;
-  lzw_data[k].parent = next;
-  DTRACE(DB_DICTIONARY, "DICT\tADD\t%u\t%u\t%u\t%#x\n", k, curr->key, l + 1, c);
+  evict_added(k, prefix, c);
+  budget_child_added(lzw_data[prefix].children++);
+  lzw_data = region_fit(&data_region, k, sizeof(lzw_data_t));
+  lzw_data[k].children = 0;
+  lzw_data[k].prefix = prefix;
+  lzw_data[k].len = lzw_data[prefix].len + 1;
+  lzw_data[k].last = c;
+  lzw_data[k].first = lzw_data[prefix].first;
+  DTRACE(DB_DICTIONARY, "DICT\tADD\t%u\t%u\t%u\t%#x\n", k, prefix,
+         lzw_data[k].len, c);
+  TRACE(.kind = LZW_TRACE_DICT_ADD, .key = k, .prefix = prefix,
+        .len = lzw_data[k].len, .c = c);
   DTRACE(DB_STATE, "APPEND(%#x)\t\tNEWSTATE %u\n", c, k);
+  TRACE_IF(DB_STATE, .kind = LZW_TRACE_NEW_STATE, .key = k, .c = c);
   return NEXT_CHAR_NEW;
 }
 
 // We also have book-keeping of when we have to
-// update the length
-static size_t lzw_data_size(void) {
-  return (1 << lzw_length) * sizeof(lzw_data_t);
-}
-
+// update the length.
 void lzw_len_update() {
   DTRACE(DB_STATE, "INCLENGTH %d->%d\n", lzw_length, lzw_length + 1)
-  size_t old_length = lzw_data_size();
+  TRACE(.kind = LZW_TRACE_INC_LENGTH, .width = lzw_length);
   lzw_length++;
-  size_t new_length = lzw_data_size();
-  ASSERT(old_length * 2 == new_length);
-  lzw_data = realloc(lzw_data, new_length);
-  memset((char *)lzw_data + old_length, 0, old_length);
 }
 
-void free_dictionary(lzw_node_p t) {
-  if (!t)
+static uint8_t *decode_scratch = NULL;
+static uint32_t decode_scratch_size = 0;
+
+// What the dictionary actually has in use, for whichever direction we're
+// running, as opposed to what we budget for.
+static uint64_t dictionary_peak = 0;
+
+uint64_t lzw_dictionary_bytes(void) {
+  uint64_t b = 0;
+  if (trie.nodes) {
+    b += (uint64_t)lzw_next_key * sizeof(lzw_node_t) +
+         trie.blocks_used * block_cost + runs_bytes;
+  }
+  if (lzw_data) {
+    b += (uint64_t)lzw_next_key * sizeof(lzw_data_t) + decode_scratch_size;
+  }
+  if (lzw_evict_data) {
+    b += (uint64_t)lzw_next_key * sizeof(lzw_evict_t);
+  }
+  if (b > dictionary_peak) {
+    dictionary_peak = b;
+  }
+  return b;
+}
+
+uint64_t lzw_dictionary_peak_bytes(void) {
+  lzw_dictionary_bytes();
+  return dictionary_peak;
+}
+
+void lzw_destroy_state(void) {
+  lzw_dictionary_bytes(); // to update the peak
+  trie_destroy(&trie);
+  if (!data_region.mapped) {
+    region_release(&data_region);
+  }
+  lzw_data = NULL;
+  if (!evict_region.mapped) {
+    region_release(&evict_region);
+  }
+  lzw_evict_data = NULL;
+  if (decode_scratch) {
+    free(decode_scratch);
+    decode_scratch = NULL;
+    decode_scratch_size = 0;
+  }
+  lzw_next_key = 0;
+  ASSERT((bitread_buffer & ((1 << bitread_buffer_size) - 1)) == 0);
+  ASSERT(bitwrite_buffer_size == 0);
+}
+
+// Our own streams are MSB-first: the oldest bits are at the top of the
+// buffer. compress(1) packs LSB-first, so there they're at the bottom.
+void bitwrite_buffer_push_bits(uint32_t v, uint8_t l) {
+  ASSERT(bitwrite_buffer_size + l < BITWRITE_BUFFER_MAX_SIZE);
+  uint32_t mask = (1 << l) - 1;
+  if (lzw_compress_bits) {
+    bitwrite_buffer |= (uint64_t)(v & mask) << bitwrite_buffer_size;
+  } else {
+    bitwrite_buffer = (bitwrite_buffer << l) | (v & mask);
+  }
+  bitwrite_buffer_size += l;
+}
+
+uint8_t bitwrite_buffer_pop_byte(void) {
+  ASSERT(bitwrite_buffer_size >= 8);
+  bitwrite_buffer_size -= 8;
+  if (lzw_compress_bits) {
+    uint8_t b = bitwrite_buffer;
+    bitwrite_buffer >>= 8;
+    return b;
+  }
+  uint8_t b = bitwrite_buffer >> bitwrite_buffer_size;
+  return b;
+}
+
+#ifndef IO_BUFFER_SIZE
+#define IO_BUFFER_SIZE 4096
+#endif
+// io_uring. With lzw_io_uring set, regular files are read and written
+// through a ring with several large registered buffers in flight at once,
+// rather than one 4K stdio buffer at a time. We drive the ring with the
+// raw system calls; if it isn't available we quietly stay on stdio.
+bool lzw_io_uring = false;
+#define URING_DEPTH 4
+#define URING_BUFFER_SIZE (1 << 18)
+
+typedef struct {
+  int fd;
+  uint32_t *sq_tail;
+  uint32_t sq_mask;
+  uint32_t *sq_array;
+  struct io_uring_sqe *sqes;
+  uint32_t *cq_head;
+  uint32_t *cq_tail;
+  uint32_t cq_mask;
+  struct io_uring_cqe *cqes;
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+  uint8_t *buffers; // URING_DEPTH of them, registered with the ring
+  uint32_t in_flight[URING_DEPTH];
+  int32_t result[URING_DEPTH];
+} lzw_uring_t;
+
+static void uring_release(lzw_uring_t *u) {
+  if (u->fd < 0) {
+    return;
+  }
+  close(u->fd);
+  u->fd = -1;
+  if (u->cq_ring && u->cq_ring != u->sq_ring) {
+    munmap(u->cq_ring, u->cq_ring_size);
+  }
+  if (u->sq_ring) {
+    munmap(u->sq_ring, u->sq_ring_size);
+  }
+  if (u->sqes) {
+    munmap(u->sqes, u->sqes_size);
+  }
+  if (u->buffers) {
+    munmap(u->buffers, URING_DEPTH * URING_BUFFER_SIZE);
+  }
+  *u = (lzw_uring_t){.fd = -1};
+}
+
+static bool uring_setup(lzw_uring_t *u) {
+  struct io_uring_params p = {0};
+  *u = (lzw_uring_t){.fd = syscall(__NR_io_uring_setup, URING_DEPTH, &p)};
+  if (u->fd < 0) {
+    return false;
+  }
+  u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+  u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (u->cq_ring_size > u->sq_ring_size) {
+      u->sq_ring_size = u->cq_ring_size;
+    }
+    u->cq_ring_size = u->sq_ring_size;
+  }
+  u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+  u->cq_ring = u->sq_ring;
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) && u->sq_ring != MAP_FAILED) {
+    u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+  }
+  u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+  u->buffers = mmap(NULL, URING_DEPTH * URING_BUFFER_SIZE,
+                    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED ||
+      u->sqes == MAP_FAILED || u->buffers == MAP_FAILED) {
+    u->sq_ring = u->sq_ring == MAP_FAILED ? NULL : u->sq_ring;
+    u->cq_ring = u->cq_ring == MAP_FAILED ? NULL : u->cq_ring;
+    u->sqes = u->sqes == MAP_FAILED ? NULL : u->sqes;
+    u->buffers = u->buffers == MAP_FAILED ? NULL : u->buffers;
+    uring_release(u);
+    return false;
+  }
+  uint8_t *sq = u->sq_ring;
+  uint8_t *cq = u->cq_ring;
+  u->sq_tail = (uint32_t *)(sq + p.sq_off.tail);
+  u->sq_mask = *(uint32_t *)(sq + p.sq_off.ring_mask);
+  u->sq_array = (uint32_t *)(sq + p.sq_off.array);
+  u->cq_head = (uint32_t *)(cq + p.cq_off.head);
+  u->cq_tail = (uint32_t *)(cq + p.cq_off.tail);
+  u->cq_mask = *(uint32_t *)(cq + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  struct iovec v[URING_DEPTH];
+  for (int i = 0; i < URING_DEPTH; i++) {
+    v[i] = (struct iovec){u->buffers + i * URING_BUFFER_SIZE, URING_BUFFER_SIZE};
+  }
+  if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_BUFFERS, v,
+              URING_DEPTH) < 0) {
+    uring_release(u);
+    return false;
+  }
+  return true;
+}
+
+static uint8_t *uring_buffer(lzw_uring_t *u, int i) {
+  return u->buffers + i * URING_BUFFER_SIZE;
+}
+
+// Queue one fixed-buffer read or write of n bytes at b (in buffer i).
+static void uring_submit(lzw_uring_t *u, uint8_t op, int fd, int i,
+                         const uint8_t *b, uint32_t n, uint64_t offset) {
+  const uint32_t tail = *u->sq_tail;
+  const uint32_t slot = tail & u->sq_mask;
+  struct io_uring_sqe *e = &u->sqes[slot];
+  memset(e, 0, sizeof(*e));
+  e->opcode = op;
+  e->fd = fd;
+  e->addr = (uintptr_t)b;
+  e->len = n;
+  e->off = offset;
+  e->buf_index = i;
+  e->user_data = i;
+  u->sq_array[slot] = slot;
+  __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  u->in_flight[i]++;
+  while (syscall(__NR_io_uring_enter, u->fd, 1, 0, 0, NULL, 0) < 0 &&
+         errno == EINTR) {
+  }
+}
+
+// Reap one completion, waiting for it if need be.
+static void uring_reap(lzw_uring_t *u) {
+  uint32_t head = *u->cq_head;
+  while (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+    syscall(__NR_io_uring_enter, u->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL,
+            0);
+  }
+  const struct io_uring_cqe *c = &u->cqes[head & u->cq_mask];
+  u->in_flight[c->user_data]--;
+  u->result[c->user_data] = c->res;
+  __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void uring_wait(lzw_uring_t *u, int i) {
+  while (u->in_flight[i]) {
+    uring_reap(u);
+  }
+}
+
+static void uring_drain(lzw_uring_t *u) {
+  for (int i = 0; i < URING_DEPTH; i++) {
+    uring_wait(u, i);
+  }
+}
+
+// Output backends. Normally we hand our buffer to stdio. When the output
+// is a pipe or a socket we skip stdio's copy and write() to it directly,
+// from a buffer the size of the pipe. (We don't vmsplice: a spliced page
+// stays ours to corrupt for as long as the reader, or whatever it splices
+// onwards to, holds on to it, and we can't know when that ends.)
+static uint8_t fwrite_buffer_default[IO_BUFFER_SIZE];
+static uint8_t *fwrite_buffer = fwrite_buffer_default;
+static size_t fwrite_buffer_size = IO_BUFFER_SIZE;
+static size_t emit_buffer_next = 0;
+static size_t emit_buffer_flushed = 0; // how much of it we've handed off
+
+static FILE *output_checked = NULL; // the lzw_output_file we set up for
+static int output_fd = -1;          // to write() to directly, if any
+static lzw_uring_t output_uring = {.fd = -1};
+static int output_uring_buffer = 0; // which one we're filling
+static uint64_t output_offset = 0;  // where its flushed part goes
+static uint8_t *output_buffer = NULL; // when direct
+static size_t output_buffer_size = 0;
+static int output_error = 0; // the first errno writing directly hit
+
+// The write each uring buffer has outstanding, until we've checked it.
+static struct {
+  const uint8_t *b;
+  uint32_t n;
+  uint64_t offset;
+} output_uring_write[URING_DEPTH];
+
+int lzw_output_error(void) { return output_error; }
+
+static void output_buffer_release(void) {
+  if (output_buffer) {
+    munmap(output_buffer, output_buffer_size);
+    output_buffer = NULL;
+  }
+  fwrite_buffer = fwrite_buffer_default;
+  fwrite_buffer_size = sizeof(fwrite_buffer_default);
+}
+
+static void output_uring_submit(int i, const uint8_t *b, uint32_t n,
+                                uint64_t offset) {
+  output_uring_write[i].b = b;
+  output_uring_write[i].n = n;
+  output_uring_write[i].offset = offset;
+  uring_submit(&output_uring, IORING_OP_WRITE_FIXED, output_fd, i, b, n,
+               offset);
+}
+
+// Wait for buffer i's write to land. We've already counted it in
+// output_offset, so a short one has to be finished, and a failed one
+// leaves a hole we can only report.
+static void output_uring_wait(int i) {
+  while (output_uring_write[i].n) {
+    uring_wait(&output_uring, i);
+    const int32_t r = output_uring.result[i];
+    const uint32_t n = output_uring_write[i].n;
+    output_uring_write[i].n = 0;
+    if (r <= 0) {
+      output_error = output_error ? output_error : r < 0 ? -r : EIO;
+    } else if (r < n) {
+      output_uring_submit(i, output_uring_write[i].b + r, n - r,
+                          output_uring_write[i].offset + r);
+    }
+  }
+}
+
+// Wait for our writes to land, and leave the file offset after them.
+static void output_uring_drain(void) {
+  if (output_uring.fd < 0) {
+    return;
+  }
+  for (int i = 0; i < URING_DEPTH; i++) {
+    output_uring_wait(i);
+  }
+  lseek(output_fd, output_offset, SEEK_SET);
+}
+
+static void output_uring_release(void) {
+  if (output_uring.fd < 0) {
+    return;
+  }
+  output_uring_drain();
+  uring_release(&output_uring);
+}
+
+// Regular files (not opened for appending, as we write at offsets) can
+// use io_uring.
+static bool output_select_uring(int fd, const struct stat *st) {
+  if (!lzw_io_uring || !S_ISREG(st->st_mode) ||
+      (fcntl(fd, F_GETFL) & O_APPEND) || !uring_setup(&output_uring)) {
+    return false;
+  }
+  fflush(lzw_output_file);
+  output_fd = fd;
+  output_offset = lseek(fd, 0, SEEK_CUR);
+  output_uring_buffer = 0;
+  fwrite_buffer = uring_buffer(&output_uring, 0);
+  fwrite_buffer_size = URING_BUFFER_SIZE;
+  return true;
+}
+
+static void output_select(void) {
+  output_uring_release();
+  output_checked = lzw_output_file;
+  output_fd = -1;
+  output_buffer_release();
+  struct stat st;
+  const int fd = fileno(lzw_output_file);
+  if (fd < 0 || fstat(fd, &st) || output_select_uring(fd, &st) ||
+      !(S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode))) {
+    return;
+  }
+  const int pipe_size = S_ISFIFO(st.st_mode) ? fcntl(fd, F_GETPIPE_SZ) : -1;
+  const size_t size = pipe_size > 0 ? pipe_size : 1 << 16;
+  void *buffer = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buffer == MAP_FAILED) {
+    return;
+  }
+  // Anything already in stdio's buffer goes first.
+  fflush(lzw_output_file);
+  output_fd = fd;
+  output_buffer = buffer;
+  output_buffer_size = size;
+}
+
+static void output_write(const uint8_t *b, size_t n) {
+  while (n) {
+    const ssize_t r = write(output_fd, b, n);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r < 0 && errno == EAGAIN) {
+      struct pollfd p = {.fd = output_fd, .events = POLLOUT};
+      poll(&p, 1, -1);
+      continue;
+    }
+    if (r <= 0) {
+      output_error = output_error ? output_error : r < 0 ? errno : EIO;
+      return;
+    }
+    b += r;
+    n -= r;
+  }
+}
+
+static size_t write_buffer_pending(void) {
+  return emit_buffer_next - emit_buffer_flushed;
+}
+
+// With io_uring, a flush just queues the write; we move on to the next
+// buffer once this one's full, waiting for that one's last write first.
+// A buffer has one write out at a time, so we can finish it if it's short.
+static void output_uring_flush(const uint8_t *b, size_t n) {
+  const int i = output_uring_buffer;
+  if (n && !output_error) {
+    output_uring_wait(i);
+    output_uring_submit(i, b, n, output_offset);
+    output_offset += n;
+  }
+  emit_buffer_flushed = emit_buffer_next;
+  if (emit_buffer_next < fwrite_buffer_size) {
+    return;
+  }
+  output_uring_buffer = (i + 1) % URING_DEPTH;
+  output_uring_wait(output_uring_buffer);
+  fwrite_buffer = uring_buffer(&output_uring, output_uring_buffer);
+  emit_buffer_next = 0;
+  emit_buffer_flushed = 0;
+}
+
+void write_buffer_flush() {
+  if (output_checked != lzw_output_file) {
+    // What we have goes out the plain way, then we pick a backend.
+    fwrite(fwrite_buffer + emit_buffer_flushed, 1, write_buffer_pending(),
+           lzw_output_file);
+    emit_buffer_next = 0;
+    emit_buffer_flushed = 0;
+    output_select();
+    return;
+  }
+  const uint8_t *b = fwrite_buffer + emit_buffer_flushed;
+  const size_t n = write_buffer_pending();
+  if (output_uring.fd >= 0) {
+    output_uring_flush(b, n);
+    return;
+  }
+  if (output_fd < 0) {
+    fwrite(b, 1, n, lzw_output_file);
+  } else {
+    output_write(b, n);
+  }
+  // Start using the direct buffer, if we've just picked one.
+  if (output_buffer) {
+    fwrite_buffer = output_buffer;
+    fwrite_buffer_size = output_buffer_size;
+  }
+  emit_buffer_next = 0;
+  emit_buffer_flushed = 0;
+}
+
+// For when the output must actually have been written.
+static void write_buffer_sync(void) {
+  write_buffer_flush();
+  output_uring_drain();
+}
+
+// Backends that still use a buffer after flushing it only move on to
+// the next one once it's full.
+static bool write_buffer_in_place(void) { return output_uring.fd >= 0; }
+
+void lzw_write_byte(uint8_t c) {
+  if (emit_buffer_next == fwrite_buffer_size) {
+    write_buffer_flush();
+  }
+  fwrite_buffer[emit_buffer_next++] = c;
+}
+
+// Copy out a buffer, flushing as we fill up.
+static void write_buffer_put(const uint8_t *s, size_t l) {
+  while (l) {
+    if (emit_buffer_next == fwrite_buffer_size) {
+      write_buffer_flush();
+    }
+    size_t n = fwrite_buffer_size - emit_buffer_next;
+    n = n < l ? n : l;
+    memcpy(fwrite_buffer + emit_buffer_next, s, n);
+    emit_buffer_next += n;
+    s += n;
+    l -= n;
+  }
+}
+
+// Reading v from "left to right", we
+// emit the l bits of v.
+void write_key(uint32_t v, uint8_t l) {
+  ASSERT((v & ((1 << l) - 1)) == v); // v doesn't have extra bits
+  DTRACE(DB_KEY_STREAM, "EMITKEY(%d):\t\t%d\t%s\n", l, v, asbits(v, l));
+  TRACE(.kind = LZW_TRACE_EMIT_KEY, .width = l, .key = v);
+  bitwrite_buffer_push_bits(v, l);
+  while (bitwrite_buffer_size >= 8) {
+    uint8_t c = bitwrite_buffer_pop_byte();
+    DTRACE(DB_BYTE_STREAM, "EMITBYTE(encode):\t%#x\t%s\n", c, asbits(c, 8));
+    TRACE_IF(DB_BYTE_STREAM, .kind = LZW_TRACE_ENCODE_EMIT_BYTE, .c = c);
+    lzw_write_byte(c);
+    lzw_bytes_written++;
+  }
+}
+
+// compress widens one key later than we do, and stops at its maximum.
+bool key_requires_bigger_length(uint32_t k) {
+  if (lzw_compress_bits) {
+    return lzw_length < lzw_compress_bits && k > (1u << lzw_length);
+  }
+  return k >= (1 << lzw_length);
+}
+
+// Pad (encoding) or skip (decoding) to the end of the current group of 8
+// codes, at the current width.
+static uint32_t group_remainder(uint64_t pos) {
+  const uint32_t group = 8 * lzw_length;
+  return (group - (pos - group_origin) % group) % group;
+}
+
+static void group_pad(void) {
+  if (!lzw_compress_bits) {
+    return;
+  }
+  for (uint32_t pad = group_remainder(lzw_bytes_written * 8 +
+                                      bitwrite_buffer_size);
+       pad;) {
+    const uint32_t l = pad < 8 ? pad : 8;
+    write_key(0, l);
+    pad -= l;
+  }
+  group_origin = lzw_bytes_written * 8 + bitwrite_buffer_size;
+}
+// The reader adds each string one key later than the writer did, so it
+// sizes its reads by the key the writer has already moved on to: ours
+// plus one, unless the writer couldn't add a child (to a parent that has
+// n children already).
+uint32_t lzw_lookahead_key(uint32_t n) {
+  if (!new_key_allowed(n)) {
+    return lzw_next_key;
+  }
+  return lzw_next_key + 1;
+}
+
+bool update_length() {
+  if (key_requires_bigger_length(lzw_next_key)) {
+    group_pad();
+    lzw_len_update();
+    return true;
+  }
+  return false;
+}
+
+// Keys 0-255 are the single bytes, and 256 is reserved for the clear-code.
+static void lzw_init_common(void) {
+  lzw_key_limit = lzw_effective_max_key();
+  dictionary_cost = initial_cost();
+  free_block_count = 0;
+  dictionary_full = false;
+  lzw_next_key = lzw_first_key();
+  lzw_length = 1;
+  while (key_requires_bigger_length(lzw_next_key)) {
+    lzw_length++;
+  }
+
+  bitread_buffer = 0;
+  bitread_buffer_size = 0;
+
+  bitwrite_buffer = 0;
+  bitwrite_buffer_size = 0;
+
+  lzw_bytes_read = 0;
+  lzw_bytes_written = 0;
+  group_origin = 0;
+}
+
+void lzw_encode_init(void) {
+  lzw_init_common();
+  trie_init(&trie);
+  evict_init();
+  runs_release(); // clear codes give the chains back
+  curr = root;
+}
+
+static void decode_init_table(void) {
+  lzw_init_common();
+  const size_t keys = lzw_key_capacity();
+  lzw_data = region_prepare(&data_region, (1 << lzw_length) * sizeof(lzw_data_t),
+                            keys * sizeof(lzw_data_t));
+  for (uint16_t i = 0; i < 256; ++i) {
+    lzw_data[i].children = 0;
+    lzw_data[i].prefix = -1;
+    lzw_data[i].len = 1;
+    lzw_data[i].last = i;
+    lzw_data[i].first = i;
+  }
+  lzw_data[lzw_clear_code].len = 0;
+  evict_init();
+}
+
+// Decoding limits. A clear code starts a new table, but not a new stream,
+// so we keep our own totals.
+uint64_t lzw_max_output = 0;
+uint32_t lzw_max_expansion = 0;
+uint64_t lzw_max_decode_bytes = 0;
+static lzw_decode_status_t decode_status = LZW_DECODE_OK;
+static uint64_t decode_read_before = 0; // in tables before this one
+static uint64_t decode_written = 0;
+
+lzw_decode_status_t lzw_decode_status(void) { return decode_status; }
+
+void lzw_decode_init(void) {
+  decode_status = LZW_DECODE_OK;
+  decode_read_before = 0;
+  decode_written = 0;
+  decode_init_table();
+}
+
+// We drop whatever's left of the stream's bits, which needn't be padding.
+static bool decode_fail(lzw_decode_status_t status) {
+  decode_status = status;
+  bitread_buffer = 0;
+  bitread_buffer_size = 0;
+  return false;
+}
+
+// After a clear code or a flush code, and at the end of the input, what's
+// left short of a key is the encoder's zero padding.
+static bool decode_check_padding(void) {
+  if (bitread_buffer & ((1ull << bitread_buffer_size) - 1)) {
+    return decode_fail(LZW_DECODE_BAD_PADDING);
+  }
+  return true;
+}
+
+// Can we write l more bytes?
+static bool decode_output_allowed(uint32_t l) {
+  if (!(lzw_max_output | lzw_max_expansion)) {
+    return true;
+  }
+  const uint64_t written = decode_written + l;
+  if (lzw_max_output && written > lzw_max_output) {
+    return decode_fail(LZW_DECODE_OUTPUT_LIMIT);
+  }
+  if (lzw_max_expansion &&
+      written > lzw_max_expansion * (decode_read_before + lzw_bytes_read)) {
+    return decode_fail(LZW_DECODE_EXPANSION_LIMIT);
+  }
+  return true;
+}
+
+// Can the table hold key k? Each key has its entry (and eviction links),
+// and we may need a byte of scratch per key for the longest string.
+static bool decode_key_allowed(uint32_t k) {
+  if (!lzw_max_decode_bytes) {
+    return true;
+  }
+  const uint64_t per_key =
+      sizeof(lzw_data_t) + (evict_enabled() ? sizeof(lzw_evict_t) : 0) + 1;
+  if ((k + 1ull) * per_key > lzw_max_decode_bytes) {
+    return decode_fail(LZW_DECODE_MEMORY_LIMIT);
+  }
+  return true;
+}
+
+static uint8_t fread_buffer_default[IO_BUFFER_SIZE];
+static uint8_t *fread_buffer = fread_buffer_default;
+static int read_buffer_next = 0;
+static int read_buffer_max = 0;
+static bool read_eof = false;
+
+// With io_uring we keep reads in flight into every buffer, and consume
+// them in order, reading straight out of the one at the front.
+static FILE *input_checked = NULL;
+static int input_fd = -1;
+static lzw_uring_t input_uring = {.fd = -1};
+static int input_uring_buffer = -1; // the one we're consuming
+static uint64_t input_offset = 0;  // where the next read starts
+static uint64_t input_uring_offset[URING_DEPTH]; // where each one's started
+static int input_error = 0; // the first errno reading directly hit
+
+int lzw_input_error(void) { return input_error; }
+
+static void input_uring_release(void) {
+  if (input_uring.fd < 0) {
     return;
-  if (t->children.use_array) {
-    for (uint16_t i = 0; i < 256; ++i) {
-      free_dictionary(t->children.all[i]);
+  }
+  uring_drain(&input_uring);
+  uring_release(&input_uring);
+  fread_buffer = fread_buffer_default;
+  read_buffer_next = 0;
+  read_buffer_max = 0;
+}
+
+static void input_uring_read(int i) {
+  input_uring_offset[i] = input_offset;
+  uring_submit(&input_uring, IORING_OP_READ_FIXED, input_fd, i,
+               uring_buffer(&input_uring, i), URING_BUFFER_SIZE,
+               input_offset);
+  input_offset += URING_BUFFER_SIZE;
+}
+
+static void input_select(void) {
+  input_uring_release();
+  input_checked = lzw_input_file;
+  struct stat st;
+  const int fd = fileno(lzw_input_file);
+  if (!lzw_io_uring || fd < 0 || fstat(fd, &st) || !S_ISREG(st.st_mode) ||
+      !uring_setup(&input_uring)) {
+    return;
+  }
+  // ftell also counts what stdio has read ahead but not handed out.
+  input_fd = fd;
+  input_offset = ftell(lzw_input_file);
+  input_uring_buffer = -1;
+  read_eof = false;
+  for (int i = 0; i < URING_DEPTH; i++) {
+    input_uring_read(i);
+  }
+}
+
+// We're done with the buffer we were consuming, so it can read ahead.
+static int input_uring_fill(void) {
+  if (input_uring_buffer >= 0) {
+    input_uring_read(input_uring_buffer);
+  }
+  input_uring_buffer = (input_uring_buffer + 1) % URING_DEPTH;
+  const int i = input_uring_buffer;
+  uint8_t *b = uring_buffer(&input_uring, i);
+  uint32_t n = 0;
+  uring_wait(&input_uring, i);
+  // A short read needn't be the end of the file, and the reads after it
+  // are already on their way, so we read the rest until it is.
+  for (;;) {
+    const int32_t r = input_uring.result[i];
+    if (r < 0 && !input_error) {
+      input_error = -r;
     }
-    free(t->children.all);
-  } else {
-    int n = t->children.local.index;
-    for (int i = 0; i < n; i++) {
-      free_dictionary(t->children.local.immediate[i].value);
+    if (r <= 0) {
+      read_eof = true;
+      break;
+    }
+    n += r;
+    if (n == URING_BUFFER_SIZE) {
+      break;
     }
+    uring_submit(&input_uring, IORING_OP_READ_FIXED, input_fd, i, b + n,
+                 URING_BUFFER_SIZE - n, input_uring_offset[i] + n);
+    uring_wait(&input_uring, i);
   }
-  free(t);
+  fread_buffer = b;
+  return n;
 }
 
-void lzw_destroy_state(void) {
-  free_dictionary(root);
-  curr = NULL;
-  root = NULL;
-  for (uint32_t i = 0; i < lzw_next_key; ++i) {
-    if (lzw_data[i].data)
-      free(lzw_data[i].data);
+// In sync mode we take whatever input is available rather than waiting
+// for a full buffer, so that the other end of a pipe isn't kept waiting.
+static int lzw_fill(void) {
+  if (input_checked != lzw_input_file) {
+    input_select();
   }
-  if (lzw_data) {
-    free(lzw_data);
-    lzw_data = NULL;
+  if (input_uring.fd >= 0) {
+    return read_eof ? 0 : input_uring_fill();
   }
-  lzw_next_key = 0;
-  ASSERT((bitread_buffer & ((1 << bitread_buffer_size) - 1)) == 0);
-  ASSERT(bitwrite_buffer_size == 0);
+  const int fd = lzw_sync ? fileno(lzw_input_file) : -1;
+  if (fd < 0) {
+    read_eof = false;
+    return fread(fread_buffer, 1, IO_BUFFER_SIZE, lzw_input_file);
+  }
+  ssize_t r;
+  do {
+    r = read(fd, fread_buffer, IO_BUFFER_SIZE);
+  } while (r < 0 && errno == EINTR);
+  if (r < 0 && !input_error) {
+    input_error = errno;
+  }
+  read_eof = r <= 0;
+  return r > 0 ? r : 0;
 }
 
-void bitwrite_buffer_push_bits(uint32_t v, uint8_t l) {
-  ASSERT(bitwrite_buffer_size + l < BITWRITE_BUFFER_MAX_SIZE);
-  uint32_t mask = (1 << l) - 1;
-  bitwrite_buffer = (bitwrite_buffer << l) | (v & mask);
-  bitwrite_buffer_size += l;
+void lzw_release_memory(void) {
+  lzw_destroy_state();
+  output_uring_release();
+  output_buffer_release();
+  output_checked = NULL;
+  input_uring_release();
+  input_checked = NULL;
+  trie_release(&trie);
+  runs_release();
+  region_release(&data_region);
+  region_release(&evict_region);
 }
 
-uint8_t bitwrite_buffer_pop_byte(void) {
-  ASSERT(bitwrite_buffer_size >= 8);
-  bitwrite_buffer_size -= 8;
-  uint8_t b = bitwrite_buffer >> bitwrite_buffer_size;
-  return b;
+uint32_t lzw_read_byte(void) {
+  if (read_buffer_next == read_buffer_max) {
+    read_buffer_max = lzw_fill();
+    read_buffer_next = 0;
+  }
+  if (read_buffer_max == 0) {
+    return EOF;
+  }
+  return fread_buffer[read_buffer_next++];
 }
 
-#ifndef IO_BUFFER_SIZE
-#define IO_BUFFER_SIZE 4096
-#endif
-static uint8_t fwrite_buffer[IO_BUFFER_SIZE];
-static int emit_buffer_next = 0;
-void write_buffer_flush() {
-  fwrite(fwrite_buffer, 1, emit_buffer_next, lzw_output_file);
-  emit_buffer_next = 0;
+// Flexible parsing (below) reads ahead into a window of its own, and
+// the input isn't done until that's been encoded too.
+enum { FLEX_LOOKAHEAD = 1 << 16 };
+static uint8_t flex_window[2 * FLEX_LOOKAHEAD];
+static size_t flex_start = 0;
+static size_t flex_end = 0;
+static bool flex_eof = false;
+
+bool input_eof(void) {
+  return read_buffer_max == 0 && flex_start == flex_end &&
+         (read_eof || feof(lzw_input_file));
 }
-void lzw_write_byte(uint8_t c) {
-  if (emit_buffer_next == sizeof(fwrite_buffer)) {
-    write_buffer_flush();
+
+// With lzw_flush_timeout_ms, if we're about to wait on input while we
+// have output pending, we sync-flush first if the input takes too long.
+static void lzw_encode_wait(void) {
+  const int fd = fileno(lzw_input_file);
+  if (fd < 0 ||
+      (curr == root && !bitwrite_buffer_size && !write_buffer_pending())) {
+    return;
+  }
+  struct pollfd p = {.fd = fd, .events = POLLIN};
+  if (poll(&p, 1, lzw_flush_timeout_ms) == 0) {
+    DTRACE(DB_STATE, "FLUSH_TIMEOUT\n");
+    TRACE_IF(DB_STATE, .kind = LZW_TRACE_FLUSH_TIMEOUT);
+    lzw_sync_flush();
   }
-  fwrite_buffer[emit_buffer_next++] = c;
 }
 
-// Reading v from "left to right", we
-// emit the l bits of v.
-void write_key(uint32_t v, uint8_t l) {
-  ASSERT((v & ((1 << l) - 1)) == v); // v doesn't have extra bits
-  DTRACE(DB_KEY_STREAM, "EMITKEY(%d):\t\t%d\t%s\n", l, v, asbits(v, l));
-  bitwrite_buffer_push_bits(v, l);
-  while (bitwrite_buffer_size >= 8) {
-    uint8_t c = bitwrite_buffer_pop_byte();
-    DTRACE(DB_BYTE_STREAM, "EMITBYTE(encode):\t%#x\t%s\n", c, asbits(c, 8));
-    lzw_write_byte(c);
-    lzw_bytes_written++;
+// Flexible parsing. Greedy parsing ends each string at its longest
+// match; with lzw_flexible set we also consider ending it up to that
+// many bytes early, and take whichever end lets the following string
+// reach furthest. The decoder still adds each string extended by the
+// next one's first byte, which for a string we cut short is already in
+// the dictionary; it gives that copy a key anyway, so we skip one too.
+//
+// That makes these streams a format change: a duplicate string can only
+// come from flexible parsing. Our decoder keeps its own table and takes
+// them, but decoders from before it split off from the encoder's trie
+// add strings through that trie and can't: debug builds assert, and
+// release builds silently go wrong. Only decode -L streams with a
+// decoder at least as new as the split.
+uint32_t lzw_flexible = 0;
+
+static void flex_fill(void) {
+  if (flex_eof || flex_end - flex_start >= FLEX_LOOKAHEAD) {
+    return;
+  }
+  memmove(flex_window, flex_window + flex_start, flex_end - flex_start);
+  flex_end -= flex_start;
+  flex_start = 0;
+  while (flex_end < sizeof(flex_window)) {
+    const int c = lzw_read_byte();
+    if (c == EOF) {
+      flex_eof = true;
+      return;
+    }
+    flex_window[flex_end++] = c;
   }
 }
 
-bool key_requires_bigger_length(uint32_t k) { return k >= (1 << lzw_length); }
-bool update_length() {
-  if (key_requires_bigger_length(lzw_next_key)) {
-    lzw_len_update();
-    return true;
+// The longest string in the dictionary at p, up to limit bytes.
+static uint32_t flex_match(size_t p, size_t limit, uint32_t *k) {
+  uint32_t node = root;
+  uint32_t n = 0;
+  limit = limit < flex_end - p ? limit : flex_end - p;
+  while (n < limit) {
+    const uint32_t next = trie_find(&trie, node, flex_window[p + n]);
+    if (next == root) {
+      break;
+    }
+    node = next;
+    n++;
   }
-  return false;
+  *k = node;
+  return n;
 }
 
-void lzw_init() {
-  root = (lzw_node_p)calloc(1, sizeof(lzw_node_t));
-  curr = root;
-  root->key = -1;
-  lzw_length = 1;
-  lzw_next_key = 0;
-  lzw_data = calloc(1 << lzw_length, sizeof(lzw_data_t));
-
-#ifndef NDEBUG
-  int old_state_key = DB_KEYS_SET[DB_STATE];
-  DB_KEYS_SET[DB_STATE] = 0;
-  int old_dict_key = DB_KEYS_SET[DB_DICTIONARY];
-  DB_KEYS_SET[DB_DICTIONARY] = 0;
-#endif
-  for (uint16_t i = 0; i < 256; ++i) {
-    lzw_next_char(i);
+static size_t lzw_encode_flexible(size_t l) {
+  size_t i = 0;
+  for (;;) {
+    flex_fill();
+    if (flex_start == flex_end) {
+      lzw_encode_end();
+      flex_eof = false; // ready for the next stream
+      break;
+    }
+    if (i > l) {
+      break;
+    }
+    uint32_t k;
+    const uint32_t n = flex_match(flex_start, SIZE_MAX, &k);
+    uint32_t best = n;
+    uint32_t reach = n + flex_match(flex_start + n, SIZE_MAX, &k);
+    // Cutting short wastes the skipped key, so it has to pay for that by
+    // reaching at least 2 bytes further than the longest match would.
+    for (uint32_t j = n - 1; j > 0 && j + lzw_flexible >= n; j--) {
+      const uint32_t r = j + flex_match(flex_start + j, SIZE_MAX, &k);
+      if (r > reach + 1) {
+        reach = r;
+        best = j;
+      }
+    }
+    flex_match(flex_start, best, &curr);
+    flex_start += best;
+    i += best;
+    if (flex_start == flex_end) {
+      continue; // lzw_encode_end() writes the last string
+    }
+    const uint8_t c = flex_window[flex_start];
+    if (trie_find(&trie, curr, c) == root) {
+      lzw_next_char(c);
+    } else if (new_key_allowed(trie.nodes[curr].children.index)) {
+      DTRACE(DB_STATE, "APPEND(%#x)\tSHORT\t%u\n", c, lzw_next_key);
+      TRACE_IF(DB_STATE, .kind = LZW_TRACE_SHORT, .key = lzw_next_key,
+               .c = c);
+      lzw_next_key++;
+      dictionary_cost += key_cost();
+    } else {
+      dictionary_full = true;
+    }
+    write_key(curr, lzw_length);
+    curr = root;
     update_length();
   }
-#ifndef NDEBUG
-  DB_KEYS_SET[DB_STATE] = old_state_key;
-  DB_KEYS_SET[DB_DICTIONARY] = old_dict_key;
-#endif
-
-  ASSERT(lzw_clear_code == lzw_next_key);
-  lzw_next_key++; // reserve 256 for the clear-code.
-  update_length();
-
-  bitread_buffer = 0;
-  bitread_buffer_size = 0;
-
-  bitwrite_buffer = 0;
-  bitwrite_buffer_size = 0;
-
-  lzw_bytes_read = 0;
-  lzw_bytes_written = 0;
+  lzw_bytes_read += i;
+  return i;
 }
 
-static uint8_t fread_buffer[IO_BUFFER_SIZE];
-static int read_buffer_next = 0;
-static int read_buffer_max = 0;
-uint32_t lzw_read_byte(void) {
-  if (read_buffer_next == read_buffer_max) {
-    read_buffer_max =
-        fread(fread_buffer, 1, sizeof(fread_buffer), lzw_input_file);
-    read_buffer_next = 0;
+// How many bytes equal to b start at p, up to n, a word at a time.
+static size_t run_span(const uint8_t *p, size_t n, uint8_t b) {
+  const uint64_t pattern = 0x0101010101010101ull * b;
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    uint64_t w[4];
+    memcpy(w, p + i, sizeof(w));
+    if ((w[0] ^ pattern) | (w[1] ^ pattern) | (w[2] ^ pattern) |
+        (w[3] ^ pattern)) {
+      break;
+    }
   }
-  if (read_buffer_max == 0) {
-    return EOF;
+  while (i < n && p[i] == b) {
+    i++;
   }
-  return fread_buffer[read_buffer_next++];
+  return i;
 }
 
-bool input_eof(void) { return read_buffer_max == 0 && feof(lzw_input_file); }
+// Called with curr a single byte b, which the next byte repeats, to take
+// the run of b that follows. Each string of the run is its
+// chain's top (or the rest of the run), so we emit exactly what the
+// byte-at-a-time loop would, without walking the trie. Returns true if,
+// as that loop would, we stop after a code past l.
+static bool lzw_encode_run(size_t *i, size_t l) {
+  const uint8_t b = curr;
+  uint32_t k = 1; // curr is b^k
+  for (;;) {
+    const size_t r = run_span(fread_buffer + read_buffer_next,
+                              read_buffer_max - read_buffer_next, b);
+    size_t used = 0;
+    bool stop = false;
+    while (used < r) {
+      const uint32_t room = run_length(b) - k;
+      if (r - used <= room) {
+        k += r - used;
+        used = r;
+        break;
+      }
+      // The next b falls off the end of the chain.
+      used += room + 1;
+      curr = run_key(b, k + room);
+      lzw_next_char(b);
+      write_key(curr, lzw_length);
+      curr = root;
+      update_length();
+      lzw_next_char(b);
+      k = 1;
+      if (*i + used > l) {
+        stop = true;
+        break;
+      }
+    }
+    read_buffer_next += used;
+    *i += used;
+    if (stop) {
+      return true;
+    }
+    // A run to the end of the buffer may go on in the next one (unless
+    // we might have to flush while waiting for it).
+    if (read_buffer_next < read_buffer_max || lzw_flush_timeout_ms) {
+      break;
+    }
+    read_buffer_max = lzw_fill();
+    read_buffer_next = 0;
+    if (!read_buffer_max) {
+      break;
+    }
+  }
+  curr = run_key(b, k);
+  return false;
+}
 
 size_t lzw_encode(size_t l) {
+  if (lzw_flexible) {
+    return lzw_encode_flexible(l);
+  }
   size_t i = 0;
   for (;;) {
+    if (lzw_flush_timeout_ms && read_buffer_next == read_buffer_max) {
+      lzw_encode_wait();
+    }
+    if (curr < 256 && read_buffer_next < read_buffer_max &&
+        fread_buffer[read_buffer_next] == curr && runs_enabled() &&
+        lzw_encode_run(&i, l)) {
+      break;
+    }
     int c = lzw_read_byte();
     if (c == EOF) {
       DTRACE(DB_BYTE_STREAM, "READBYTE(encode):\t%d\n", c);
       DTRACE(DB_STATE, "lzw_encode:eof\n");
+      TRACE_IF(DB_BYTE_STREAM, .kind = LZW_TRACE_ENCODE_READ_BYTE, .key = 1);
+      TRACE_IF(DB_STATE, .kind = LZW_TRACE_ENCODE_EOF);
       lzw_encode_end();
       break;
     }
     i++;
     DTRACE(DB_BYTE_STREAM, "READBYTE(encode):\t%#x\t%s\n", c, asbits(c, 8));
+    TRACE_IF(DB_BYTE_STREAM, .kind = LZW_TRACE_ENCODE_READ_BYTE, .c = c);
     if (lzw_next_char(c) != NEXT_CHAR_CONTINUE) {
-      write_key(curr->key, lzw_length);
+      write_key(curr, lzw_length);
       curr = root;
       update_length();
       lzw_next_char(c);
@@ -370,35 +1822,68 @@ size_t lzw_encode(size_t l) {
   return i;
 }
 
-void lzw_write_clear_code(void) {
-  DTRACE(DB_STATE, "CLEAR_CODE\t%zu\t%d\n", lzw_bytes_written, input_eof());
-  if (input_eof()) {
-    return; // don't bother
-  }
+// Before a control code, we end the current string early.
+static void lzw_end_string(void) {
   if (curr != root) {
-    write_key(curr->key, lzw_length);
-    curr = root;
+    // The decoder touches every key it reads, so we must too.
+    evict_touch(curr);
+    write_key(curr, lzw_length);
     // When we read in a code, we always assume that it's a new key
     // (unless if we're at the max). So our reader preemptively
     // updates the length at the key boundaries---we need to do that
     // here too, even though this key isn't new.
-    if (key_requires_bigger_length(lzw_next_key + 1)) {
+    const uint32_t n = trie.nodes[curr].children.index;
+    curr = root;
+    if (key_requires_bigger_length(lzw_lookahead_key(n))) {
+      group_pad();
       lzw_len_update();
     }
   }
+}
+
+void lzw_write_clear_code(void) {
+  DTRACE(DB_STATE, "CLEAR_CODE\t%zu\t%d\n", lzw_bytes_written, input_eof());
+  TRACE(.kind = LZW_TRACE_CLEAR_CODE, .pos = lzw_bytes_written,
+        .c = input_eof());
+  if (input_eof()) {
+    return; // don't bother
+  }
+  lzw_end_string();
   write_key(lzw_clear_code, lzw_length);
+  group_pad();
   lzw_encode_end();
 }
 
+// Like zlib's Z_SYNC_FLUSH: after this, everything read so far can be
+// decoded from what's been written, and we've handed it all to the OS.
+void lzw_sync_flush(void) {
+  ASSERT(lzw_sync);
+  DTRACE(DB_STATE, "SYNC_FLUSH\t%zu\t%d\n", lzw_bytes_written, input_eof());
+  TRACE(.kind = LZW_TRACE_SYNC_FLUSH, .pos = lzw_bytes_written,
+        .c = input_eof());
+  if (input_eof()) {
+    return; // lzw_encode_end() already wrote everything
+  }
+  lzw_end_string();
+  write_key(lzw_flush_code, lzw_length);
+  if (bitwrite_buffer_size != 0) {
+    write_key(0, 8 - (bitwrite_buffer_size % 8));
+  }
+  write_buffer_sync();
+  fflush(lzw_output_file);
+}
+
 void lzw_encode_end(void) {
   // if we haven't done anything yet, make that more explicit
   DTRACE(DB_STATE, "ENCODE_END\t%u\t%zu\t%d\n", bitwrite_buffer_size,
          lzw_bytes_written, curr == root);
+  TRACE(.kind = LZW_TRACE_ENCODE_END, .width = bitwrite_buffer_size,
+        .pos = lzw_bytes_written, .c = curr == root);
   if (bitwrite_buffer_size == 0 && lzw_bytes_written == 0 && curr == root) {
     return;
   }
   if (curr != root) {
-    write_key(curr->key, lzw_length);
+    write_key(curr, lzw_length);
     curr = root;
   }
   if (bitwrite_buffer_size != 0) {
@@ -410,113 +1895,386 @@ void lzw_encode_end(void) {
     write_key(0, bits_to_add);
     ASSERT(bitwrite_buffer_size == 0);
   }
-  write_buffer_flush();
+  write_buffer_sync();
+}
+
+// Interleaved encoding. A single encode is a chain of dependent trie
+// lookups, so it spends most of its time waiting on memory. Here we
+// advance several independent streams in turn, prefetching each one's
+// next node while we work on the others. Each stream has its own trie,
+// key state, bit buffer and I/O buffers, and its output is exactly what
+// lzw_encode (without clear codes, eviction or a byte budget) would
+// write for that input alone.
+typedef struct {
+  lzw_trie_t trie;
+  FILE *in;
+  FILE *out;
+  uint32_t curr;
+  uint32_t next_key;
+  uint32_t length;
+  uint64_t bits;
+  uint32_t bits_size;
+  uint64_t bytes_written;
+  int in_next;
+  int in_max;
+  int out_next;
+  uint8_t in_buffer[IO_BUFFER_SIZE];
+  uint8_t out_buffer[IO_BUFFER_SIZE];
+} lzw_stream_t;
+
+static void stream_write_bits(lzw_stream_t *s, uint32_t v, uint8_t l) {
+  ASSERT((v & ((1 << l) - 1)) == v);
+  s->bits = (s->bits << l) | v;
+  s->bits_size += l;
+  while (s->bits_size >= 8) {
+    s->bits_size -= 8;
+    if (s->out_next == sizeof(s->out_buffer)) {
+      fwrite(s->out_buffer, 1, s->out_next, s->out);
+      s->out_next = 0;
+    }
+    s->out_buffer[s->out_next++] = s->bits >> s->bits_size;
+    s->bytes_written++;
+  }
+}
+
+// The same steps as lzw_encode and lzw_next_char, one byte at a time.
+// Returns false once the input is exhausted.
+static inline bool stream_step(lzw_stream_t *s) {
+  if (s->in_next == s->in_max) {
+    s->in_max = fread(s->in_buffer, 1, sizeof(s->in_buffer), s->in);
+    s->in_next = 0;
+    if (s->in_max == 0) {
+      return false;
+    }
+  }
+  const uint8_t c = s->in_buffer[s->in_next++];
+  uint32_t next = trie_find(&s->trie, s->curr, c);
+  if (next == root) {
+    stream_write_bits(s, s->curr, s->length);
+    if (!lzw_key_limit || s->next_key < lzw_key_limit) {
+      trie_add(&s->trie, s->curr, c, s->next_key++);
+      if (s->next_key >= (1u << s->length)) {
+        s->length++;
+      }
+    }
+    next = c; // the root's child for c is always c.
+  }
+  s->curr = next;
+  __builtin_prefetch(&s->trie.nodes[next]);
+  return true;
+}
+
+// Mirrors lzw_encode_end.
+static void stream_finish(lzw_stream_t *s) {
+  if (s->bits_size != 0 || s->bytes_written != 0 || s->curr != root) {
+    if (s->curr != root) {
+      stream_write_bits(s, s->curr, s->length);
+    }
+    if (s->bits_size != 0) {
+      stream_write_bits(s, 0, 8 - (s->bits_size % 8));
+    }
+    fwrite(s->out_buffer, 1, s->out_next, s->out);
+  }
+  trie_release(&s->trie);
+}
+
+void lzw_encode_interleaved(size_t n, FILE **in, FILE **out) {
+  ASSERT(!lzw_evict && !lzw_max_dictionary_bytes);
+  lzw_key_limit = lzw_effective_max_key();
+  lzw_stream_t *streams = calloc(n, sizeof(lzw_stream_t));
+  lzw_stream_t **live = calloc(n, sizeof(lzw_stream_t *));
+  for (size_t i = 0; i < n; i++) {
+    lzw_stream_t *s = &streams[i];
+    trie_init(&s->trie);
+    s->in = in[i];
+    s->out = out[i];
+    s->curr = root;
+    s->next_key = lzw_first_key();
+    s->length = 1;
+    while (s->next_key >= (1u << s->length)) {
+      s->length++;
+    }
+    live[i] = s;
+  }
+  size_t live_count = n;
+  while (live_count) {
+    for (size_t i = 0; i < live_count;) {
+      if (stream_step(live[i])) {
+        i++;
+        continue;
+      }
+      stream_finish(live[i]);
+      live[i] = live[--live_count];
+    }
+  }
+  free(live);
+  free(streams);
 }
 
 void bitread_buffer_push_byte(uint8_t c) {
   ASSERT(bitread_buffer_size + 8 < BITREAD_BUFFER_MAX_SIZE);
-  bitread_buffer <<= 8;
-  bitread_buffer |= c;
+  if (lzw_compress_bits) {
+    bitread_buffer |= (uint64_t)c << bitread_buffer_size;
+  } else {
+    bitread_buffer <<= 8;
+    bitread_buffer |= c;
+  }
   bitread_buffer_size += 8;
 }
 
-uint32_t bitread_buffer_pop_bits(uint32_t bitcount) {
+static uint32_t bitread_buffer_peek_bits(uint32_t bitcount) {
   ASSERT(bitread_buffer_size >= bitcount);
   uint64_t bitread_buffer_copy = bitread_buffer;
-  // slide down the "oldest" bits
-  bitread_buffer_copy >>= (bitread_buffer_size - bitcount);
-  bitread_buffer_copy &= (1 << bitcount) - 1;
+  if (!lzw_compress_bits) {
+    // slide down the "oldest" bits
+    bitread_buffer_copy >>= (bitread_buffer_size - bitcount);
+  }
+  return bitread_buffer_copy & ((1 << bitcount) - 1);
+}
+
+uint32_t bitread_buffer_pop_bits(uint32_t bitcount) {
+  const uint32_t v = bitread_buffer_peek_bits(bitcount);
+  if (lzw_compress_bits) {
+    bitread_buffer >>= bitcount;
+  }
   bitread_buffer_size -= bitcount;
-  return bitread_buffer_copy;
+  return v;
 }
 
-// This will read the next bits up to our buffer.
-bool read_bits(uint32_t *v) {
+// Fill our buffer up to the next key, and look at it without consuming it.
+static bool peek_bits(uint32_t *v) {
   while (bitread_buffer_size < lzw_length) {
     uint32_t c = lzw_read_byte();
     if (c == EOF) {
       DTRACE(DB_BYTE_STREAM, "READBYTE(decode):\t%d\n", c);
+      TRACE_IF(DB_BYTE_STREAM, .kind = LZW_TRACE_DECODE_READ_BYTE, .key = 1);
       return false;
     }
     DTRACE(DB_BYTE_STREAM, "READBYTE(decode):\t%#x\t%s\n", c, asbits(c, 8));
+    TRACE_IF(DB_BYTE_STREAM, .kind = LZW_TRACE_DECODE_READ_BYTE, .c = c);
     lzw_bytes_read++;
     bitread_buffer_push_byte(c);
   }
-  *v = bitread_buffer_pop_bits(lzw_length);
+  *v = bitread_buffer_peek_bits(lzw_length);
+  return true;
+}
+
+// This will read the next bits up to our buffer.
+bool read_bits(uint32_t *v) {
+  if (!peek_bits(v)) {
+    return false;
+  }
+  bitread_buffer_pop_bits(lzw_length);
+  return true;
+}
+
+// The decoder's side of group_pad.
+static void group_skip(void) {
+  if (!lzw_compress_bits) {
+    return;
+  }
+  uint32_t pad =
+      group_remainder(lzw_bytes_read * 8 - bitread_buffer_size);
+  while (pad) {
+    if (!bitread_buffer_size) {
+      const uint32_t c = lzw_read_byte();
+      if (c == EOF) {
+        break;
+      }
+      lzw_bytes_read++;
+      bitread_buffer_push_byte(c);
+    }
+    const uint32_t l = pad < bitread_buffer_size ? pad : bitread_buffer_size;
+    bitread_buffer_pop_bits(l);
+    pad -= l;
+  }
+  group_origin = lzw_bytes_read * 8 - bitread_buffer_size;
+}
+
+size_t lzw_write_compress_header(void) {
+  ASSERT(lzw_compress_bits);
+  lzw_write_byte(compress_magic[0]);
+  lzw_write_byte(compress_magic[1]);
+  lzw_write_byte(compress_block_mode | lzw_compress_bits);
+  write_buffer_flush();
+  return 3;
+}
+
+// We only read block-mode streams (those compress has written since 1986),
+// as before that 256 was an ordinary key. Nor do we take 9-bit streams:
+// decoders widen those to 10 bits once the table is full, which our key
+// limit doesn't model.
+bool lzw_read_compress_header(void) {
+  uint32_t h[3];
+  for (int i = 0; i < 3; i++) {
+    h[i] = lzw_read_byte();
+    if (h[i] == EOF) {
+      return false;
+    }
+  }
+  const uint32_t bits = h[2] & 0x1f;
+  if (h[0] != compress_magic[0] || h[1] != compress_magic[1] ||
+      !(h[2] & compress_block_mode) || bits < 10 || bits > 16) {
+    return false;
+  }
+  lzw_compress_bits = bits;
   return true;
 }
 
 bool lzw_valid_key(uint32_t k) {
   ASSERT(k < (1 << (lzw_length)));
-  return lzw_data[k].data != NULL;
+  return k < lzw_next_key && (k < lzw_clear_code || k >= lzw_first_key());
+}
+
+// The decoder's table stores strings back-to-front, so we fill them in
+// from the end. Usually that's directly into the output buffer; strings
+// too long for it go through a scratch buffer.
+void lzw_write_string(uint32_t k) {
+  const uint32_t l = lzw_data[k].len;
+  uint8_t *s;
+  if (l <= fwrite_buffer_size - emit_buffer_next ||
+      (l <= fwrite_buffer_size && !write_buffer_in_place())) {
+    if (fwrite_buffer_size - emit_buffer_next < l) {
+      write_buffer_flush();
+    }
+    s = fwrite_buffer + emit_buffer_next;
+    emit_buffer_next += l;
+  } else {
+    if (decode_scratch_size < l) {
+      decode_scratch = realloc(decode_scratch, l);
+      decode_scratch_size = l;
+    }
+    s = decode_scratch;
+  }
+  for (uint32_t i = l; i-- > 0;) {
+    s[i] = lzw_data[k].last;
+    k = lzw_data[k].prefix;
+  }
+#ifndef NDEBUG
+  for (uint32_t i = 0; i < l; ++i) {
+    DTRACE(DB_BYTE_STREAM, "EMITBYTE(decode):\t%#x\n", s[i]);
+  }
+#endif
+  if (trace_events && trace_categories & 1u << DB_BYTE_STREAM) {
+    for (uint32_t i = 0; i < l; ++i) {
+      TRACE(.kind = LZW_TRACE_DECODE_EMIT_BYTE, .c = s[i]);
+    }
+  }
+  if (s == decode_scratch) {
+    write_buffer_put(s, l);
+  }
 }
 
 size_t lzw_decode(size_t limit) {
   uint32_t curr_key;
   size_t read = 0;
-  while (read < limit && read_bits(&curr_key)) {
+  if (decode_status != LZW_DECODE_OK) {
+    write_buffer_sync();
+    return 0;
+  }
+  while (read < limit) {
+    if (!read_bits(&curr_key)) {
+      decode_check_padding();
+      break;
+    }
     DTRACE(DB_KEY_STREAM, "READKEY(%d):\t\t%d\t%s\n", lzw_length, curr_key,
            asbits(curr_key, lzw_length));
+    TRACE(.kind = LZW_TRACE_READ_KEY, .width = lzw_length, .key = curr_key);
+    if (lzw_sync && curr_key == lzw_flush_code) {
+      DTRACE(DB_STATE, "DECODE\tFLUSH_CODE\n");
+      TRACE(.kind = LZW_TRACE_DECODE_FLUSH);
+      // We never read a byte further than the key, so that's all padding.
+      if (!decode_check_padding()) {
+        break;
+      }
+      bitread_buffer_size -= bitread_buffer_size % 8;
+      write_buffer_sync();
+      fflush(lzw_output_file);
+      continue;
+    }
     if (curr_key == lzw_clear_code) {
       DTRACE(DB_STATE, "DECODE\tCLEAR_CODE\n");
+      TRACE(.kind = LZW_TRACE_DECODE_CLEAR);
+      group_skip();
+      if (!decode_check_padding()) {
+        break;
+      }
+      decode_read_before += lzw_bytes_read;
       lzw_destroy_state();
       // Curious thing: we can return a value greater than lzw_bytes_read,
-      // as lzw_init() set that back to 0. We continue because we also
-      // promise to always emit something when we're called.
-      lzw_init();
+      // as decode_init_table() set that back to 0. We continue because we
+      // also promise to always emit something when we're called.
+      decode_init_table();
       continue;
     }
-    ASSERT(lzw_valid_key(curr_key));
+    if (!lzw_valid_key(curr_key)) {
+      decode_fail(LZW_DECODE_BAD_KEY);
+      break;
+    }
+    evict_touch(curr_key);
 
     // emit that string:
-    uint8_t *s = lzw_data[curr_key].data;
-    uint32_t l = lzw_data[curr_key].len;
+    const uint32_t prev_key = curr_key;
+    const uint32_t l = lzw_data[curr_key].len;
     ASSERT(l);
-    for (uint32_t i = 0; i < l; ++i) {
-      DTRACE(DB_BYTE_STREAM, "EMITBYTE(decode):\t%#x\n", s[i]);
-      lzw_write_byte(s[i]);
+    if (!decode_output_allowed(l)) {
+      break;
     }
+    lzw_write_string(curr_key);
     lzw_bytes_written += l;
+    decode_written += l;
     read += l;
-    curr = lzw_data[curr_key].parent;
 
-    if (key_requires_bigger_length(lzw_next_key + 1)) {
+    if (key_requires_bigger_length(
+            lzw_lookahead_key(lzw_data[curr_key].children))) {
+      group_skip();
       lzw_len_update();
     }
 
     // peek at the next string:
     DTRACE(DB_STATE, "DECODE(peek)\n");
-    if (!read_bits(&curr_key)) {
+    TRACE_IF(DB_STATE, .kind = LZW_TRACE_DECODE_PEEK);
+    if (!peek_bits(&curr_key)) {
       DTRACE(DB_STATE, "DECODE(break)\n");
+      TRACE_IF(DB_STATE, .kind = LZW_TRACE_DECODE_BREAK);
       // We're at EOF, so just early-out
+      decode_check_padding();
       break;
     }
-    if (curr_key == lzw_clear_code) {
+    if (curr_key == lzw_clear_code ||
+        (lzw_sync && curr_key == lzw_flush_code)) {
       // Skip our checks: we don't want to evolve our state.
-      bitread_buffer_size += lzw_length;
       continue;
     }
     DTRACE(DB_STATE, "DECODE(continue)\n");
-    bitread_buffer_size += lzw_length;
+    TRACE_IF(DB_STATE, .kind = LZW_TRACE_DECODE_CONTINUE);
 
     // Find the next character.
-    // If the next key is valid, that means
-    // the next key is already something we've seen,
-    // otherwise it's going to be the key for the new
-    // string. Either way, we take the next step
-    // on that character, but then manually reset
-    // our curr node back to the root in prep for
-    // really reading the next string.
-    if (lzw_valid_key(curr_key)) {
-      s = lzw_data[curr_key].data;
-    } else {
-      ASSERT(curr_key - 1 == lzw_clear_code || lzw_valid_key(curr_key - 1));
+    // If the next key is the one we're about to assign,
+    // the new string starts with the same character
+    // as the string we just emitted. Otherwise it's
+    // something we've already seen.
+    const uint32_t k = lzw_reserve_key(prev_key);
+    uint8_t c = lzw_data[prev_key].first;
+    if (curr_key != k) {
+      if (!lzw_valid_key(curr_key)) {
+        decode_fail(LZW_DECODE_BAD_KEY);
+        break;
+      }
+      c = lzw_data[curr_key].first;
     }
-    DEBUG_STMT(int b =)
-    lzw_next_char(s[0]);
-    ASSERT(b != NEXT_CHAR_CONTINUE);
-    curr = root;
+    if (k != root && !decode_key_allowed(k)) {
+      break;
+    }
+    lzw_add_string(k, prev_key, c);
+  }
+  // Direct output holds on to a full buffer's worth, unless we're done,
+  // which includes stopping at an error: what we've decoded up to it
+  // is what we report having written.
+  if (output_fd < 0) {
+    write_buffer_flush();
+  } else if (read < limit || decode_status != LZW_DECODE_OK) {
+    write_buffer_sync();
   }
-  write_buffer_flush();
   return read;
 }
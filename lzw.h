@@ -1,3 +1,4 @@
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -5,15 +6,111 @@
 size_t lzw_encode(size_t);
 void lzw_encode_end(void);
 size_t lzw_decode(size_t);
-void lzw_init(void);
+void lzw_encode_init(void);
+void lzw_decode_init(void);
 void lzw_destroy_state(void);
+void lzw_release_memory(void);
 void lzw_write_clear_code(void);
+void lzw_sync_flush(void);
+void lzw_encode_interleaved(size_t, FILE **, FILE **);
+size_t lzw_write_compress_header(void);
+bool lzw_read_compress_header(void);
 
 void lzw_set_debug_string(const char*);
 
+// Decoding never trusts its input. On a key that can't have been
+// assigned, or once a stream passes one of the limits below (0 for
+// none), lzw_decode() stops, returns 0 from then on, and the status
+// says why. The limits count from lzw_decode_init(), across clear codes.
+typedef enum {
+  LZW_DECODE_OK = 0,
+  LZW_DECODE_BAD_KEY,
+  LZW_DECODE_BAD_PADDING,     // stray bits where padding goes: truncated?
+  LZW_DECODE_OUTPUT_LIMIT,    // lzw_max_output bytes
+  LZW_DECODE_EXPANSION_LIMIT, // lzw_max_expansion bytes out per byte in
+  LZW_DECODE_MEMORY_LIMIT,    // lzw_max_decode_bytes of dictionary
+} lzw_decode_status_t;
+lzw_decode_status_t lzw_decode_status(void);
+
+// Binary tracing, in release builds too. Events go into a ring of the
+// given size (rounded up to a power of two) mapped onto a file, which
+// always holds the latest ones; lzw_trace renders it as the -g text.
+// Keys, dictionary changes and control codes are always recorded; the
+// per-byte state and byte stream events only for the categories that
+// lzw_set_debug_string picked, so they cost nothing otherwise.
+enum {
+  LZW_TRACE_EMIT_KEY = 1,
+  LZW_TRACE_READ_KEY,
+  LZW_TRACE_DICT_ADD,
+  LZW_TRACE_DICT_EVICT,
+  LZW_TRACE_MAX_KEY,
+  LZW_TRACE_INC_LENGTH,
+  LZW_TRACE_CLEAR_CODE,
+  LZW_TRACE_SYNC_FLUSH,
+  LZW_TRACE_ENCODE_END,
+  LZW_TRACE_DECODE_CLEAR,
+  LZW_TRACE_DECODE_FLUSH,
+  LZW_TRACE_STATE,     // -g s from here on
+  LZW_TRACE_NEW_STATE,
+  LZW_TRACE_SHORT,
+  LZW_TRACE_FLUSH_TIMEOUT,
+  LZW_TRACE_ENCODE_EOF,
+  LZW_TRACE_DECODE_PEEK,
+  LZW_TRACE_DECODE_BREAK,
+  LZW_TRACE_DECODE_CONTINUE,
+  LZW_TRACE_ENCODE_READ_BYTE, // -g b from here on; key is 1 at EOF
+  LZW_TRACE_ENCODE_EMIT_BYTE,
+  LZW_TRACE_DECODE_READ_BYTE,
+  LZW_TRACE_DECODE_EMIT_BYTE,
+};
+typedef struct {
+  uint8_t kind;
+  uint8_t width; // the code width (pending bits, for ENCODE_END)
+  uint8_t c;     // a byte, or a flag
+  uint8_t unused;
+  uint32_t key;
+  uint32_t prefix;
+  uint32_t len;
+  uint64_t pos; // bytes written, for the control events
+} lzw_trace_event_t;
+#define LZW_TRACE_MAGIC "LZWTRACE"
+#define LZW_TRACE_VERSION 2
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t event_size;
+  uint64_t capacity;
+  uint64_t next; // events written so far
+} lzw_trace_header_t;
+
+bool lzw_trace_open(const char *, uint64_t);
+void lzw_trace_close(void);
+
+uint64_t lzw_dictionary_bytes(void);
+uint64_t lzw_dictionary_peak_bytes(void);
+bool lzw_dictionary_full(void);
+
+// The first error (an errno) writing the output other than through stdio.
+int lzw_output_error(void);
+// Likewise for reading the input; we stop there, as if at its end.
+int lzw_input_error(void);
+
 extern FILE* lzw_input_file;
 extern FILE* lzw_output_file;
 extern uint32_t lzw_max_key;
+extern uint64_t lzw_max_dictionary_bytes;
+extern bool lzw_huge_pages;
+extern bool lzw_evict;
+extern bool lzw_sync;
+extern uint32_t lzw_flush_timeout_ms;
+extern uint32_t lzw_compress_bits;
+extern bool lzw_io_uring;
+// Flexible parsing; its streams need a decoder that takes duplicate
+// strings, which older ones don't (see lzw.c).
+extern uint32_t lzw_flexible;
+extern uint64_t lzw_max_output;
+extern uint32_t lzw_max_expansion;
+extern uint64_t lzw_max_decode_bytes;
 
 extern uint64_t lzw_bytes_written;
 extern uint64_t lzw_bytes_read;
\ No newline at end of file
@@ -1,18 +1,26 @@
+#define _GNU_SOURCE
 #include "lzw.h"
 #include <assert.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 int getopt(int, char *const[], const char *);
 char *optarg;
+extern int optind;
 
 bool do_decode = false;
 bool do_encode = false;
 bool do_ratio = false;
+bool reset_when_full = false;
+size_t flush_bytes = 0;
 bool trace_ratio = false;
 char *ratio_log_filename = NULL;
 
@@ -51,9 +59,35 @@ void reset_written() {
   prev_bytes_read = 0;
 }
 
-void decode_stream() {
+static const char *decode_status_message(lzw_decode_status_t status) {
+  switch (status) {
+  case LZW_DECODE_BAD_KEY:
+    return "the stream has a key that was never assigned";
+  case LZW_DECODE_BAD_PADDING:
+    return "the stream has stray bits where padding belongs";
+  case LZW_DECODE_OUTPUT_LIMIT:
+    return "the output is over its limit (-O)";
+  case LZW_DECODE_EXPANSION_LIMIT:
+    return "the stream expands more than allowed (-X)";
+  case LZW_DECODE_MEMORY_LIMIT:
+    return "the dictionary is over its memory limit (-D)";
+  default:
+    return "unknown decoding error";
+  }
+}
+
+// Output from earlier auto-tuned blocks, for error messages.
+static uint64_t decoded_before = 0;
+
+// Decoding reports bad input rather than exiting, so fuzzing can feed
+// it anything.
+bool decode_stream() {
   total_stream_written = 0;
-  lzw_init();
+  if (lzw_compress_bits && !lzw_read_compress_header()) {
+    fprintf(stderr, "Error, not a block-mode compress (.Z) stream\n");
+    return false;
+  }
+  lzw_decode_init();
   // Decode is guaranteed to make progress (even in presence of clear-codes)
   for (;;) {
     size_t written = lzw_decode(page_size);
@@ -62,10 +96,19 @@ void decode_stream() {
     }
     total_stream_written += written;
   }
+  const lzw_decode_status_t status = lzw_decode_status();
   lzw_destroy_state();
+  if (status != LZW_DECODE_OK) {
+    fflush(lzw_output_file);
+    fprintf(stderr, "Error, %s, after %lu bytes\n",
+            decode_status_message(status),
+            decoded_before + total_stream_written);
+    return false;
+  }
+  return true;
 }
 
-void encode_stream() {
+static void encode_pass() {
   total_stream_read = 0;
   total_stream_written = 0;
   FILE *ratio_log_file = stderr;
@@ -75,6 +118,10 @@ void encode_stream() {
 
   const int ema_delay = 32;
 
+  if (lzw_compress_bits) {
+    total_stream_written += lzw_write_compress_header();
+  }
+
   for (int block_count = 0;; block_count++) {
     reset_written();
     double ema_slow = 0.0;
@@ -82,7 +129,8 @@ void encode_stream() {
     double ema_fast = 0.0;
     double ema_fast_alpha = 0.01;
 
-    lzw_init();
+    lzw_encode_init();
+    uint64_t flushed_at = 0;
 
     for (int page_count = 0;; page_count++) {
       // fprintf(stderr, "processing page: %d\n", page_count);
@@ -95,6 +143,11 @@ void encode_stream() {
         return;
       }
 
+      if (flush_bytes && lzw_bytes_read - flushed_at >= flush_bytes) {
+        lzw_sync_flush();
+        flushed_at = lzw_bytes_read;
+      }
+
       // We've processed a page's worth of data, now
       // evaluate our compression ratio and windows.
       double compression_ratio = next_ratio();
@@ -115,8 +168,9 @@ void encode_stream() {
       }
 
       // Now consume our ratio information: should we start a new block?
-      if (do_ratio && page_count >= ema_delay &&
-          (ema_slow * 1.5 < ema_fast || ema_fast > 0.7)) {
+      if ((do_ratio && page_count >= ema_delay &&
+           (ema_slow * 1.5 < ema_fast || ema_fast > 0.7)) ||
+          (reset_when_full && lzw_dictionary_full())) {
         if (trace_ratio) {
           fprintf(ratio_log_file, "resetting %d\n", page_count);
         }
@@ -130,13 +184,286 @@ void encode_stream() {
   }
 }
 
-// process_stream consumes all the globally-set parameters
-void process_stream() {
-  if (do_decode) {
-    decode_stream();
+static ssize_t count_write(void *cookie, const char *buffer, size_t size) {
+  return size;
+}
+
+// Flexible parsing usually takes fewer codes than greedy parsing, but
+// the keys its cut-short strings waste can cost it more than that, and
+// we can't tell which until the end (the dictionaries differ from the
+// first cut on). So with -L we encode the input both ways, only counting
+// the output, and then for real with whichever came out smaller.
+void encode_stream() {
+  if (!lzw_flexible) {
+    encode_pass();
+    return;
+  }
+  FILE *in = lzw_input_file;
+  FILE *out = lzw_output_file;
+  // We read the input three times; if we can't seek it, we keep a copy.
+  char *copy = NULL;
+  size_t copy_size = 0;
+  long start = ftell(in);
+  if (start < 0) {
+    FILE *copy_file = open_memstream(&copy, &copy_size);
+    char buffer[1 << 16];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+      fwrite(buffer, 1, n, copy_file);
+    }
+    fclose(copy_file);
+    lzw_input_file = fmemopen(copy, copy_size, "r");
+    start = 0;
+  }
+
+  const uint32_t flexible = lzw_flexible;
+  const bool traced = trace_ratio;
+  trace_ratio = false;
+  uint64_t sizes[2];
+  lzw_output_file =
+      fopencookie(NULL, "w", (cookie_io_functions_t){.write = count_write});
+  for (int parse = 0; parse < 2; parse++) {
+    lzw_flexible = parse ? flexible : 0;
+    fseek(lzw_input_file, start, SEEK_SET);
+    encode_pass();
+    sizes[parse] = total_stream_written;
+    // The next pass reads and writes afresh.
+    lzw_release_memory();
+  }
+  fclose(lzw_output_file);
+  trace_ratio = traced;
+  if (verbosity) {
+    fprintf(stderr, "flexible parsing: %lu bytes, greedy: %lu bytes\n",
+            sizes[1], sizes[0]);
+  }
+
+  lzw_output_file = out;
+  lzw_flexible = sizes[1] < sizes[0] ? flexible : 0;
+  fseek(lzw_input_file, start, SEEK_SET);
+  encode_pass();
+  lzw_flexible = flexible;
+  if (copy) {
+    fclose(lzw_input_file);
+    free(copy);
+  }
+  lzw_input_file = in;
+}
+
+// Batch mode: encode each named file FILE into FILE.lzw. We give the
+// library several at a time so it can interleave their dictionary walks.
+enum { BATCH_WIDTH = 8 };
+void encode_batch(int count, char *names[]) {
+  for (int i = 0; i < count; i += BATCH_WIDTH) {
+    size_t width = count - i < BATCH_WIDTH ? count - i : BATCH_WIDTH;
+    FILE *in[BATCH_WIDTH];
+    FILE *out[BATCH_WIDTH];
+    for (size_t j = 0; j < width; j++) {
+      char *name = malloc(strlen(names[i + j]) + sizeof(".lzw"));
+      sprintf(name, "%s.lzw", names[i + j]);
+      in[j] = fopen(names[i + j], "r");
+      assert(in[j]);
+      out[j] = fopen(name, "wx");
+      assert(out[j]);
+      free(name);
+    }
+    lzw_encode_interleaved(width, in, out);
+    for (size_t j = 0; j < width; j++) {
+      fclose(in[j]);
+      fclose(out[j]);
+    }
+  }
+}
+
+// Auto-tuning: we cut the input into blocks and encode each block under
+// every candidate setting at once, each in a forked child (so each gets its
+// own copy of the library's state), keeping the smallest. Every block is
+// framed with the settings it used and its encoded length.
+typedef struct {
+  uint32_t max_key;
+  bool reset_when_full;
+  bool do_ratio;
+} tuning_t;
+static const tuning_t tunings[] = {
+    {4096, false, false},  {4096, true, false},  {4096, false, true},
+    {16384, false, false}, {16384, true, false}, {16384, false, true},
+    {65536, false, false}, {65536, true, false}, {65536, false, true},
+};
+enum { TUNING_COUNT = sizeof(tunings) / sizeof(tunings[0]) };
+enum { TUNING_HEADER_SIZE = 9 };
+size_t auto_block_size = 0;
+
+static void put_u32(uint8_t *b, uint32_t v) {
+  for (int i = 0; i < 4; i++) {
+    b[i] = v >> (8 * i);
+  }
+}
+
+static uint32_t get_u32(const uint8_t *b) {
+  return b[0] | b[1] << 8 | b[2] << 16 | (uint32_t)b[3] << 24;
+}
+
+// Runs in the child: encode the block into dst, leaving its size in *size.
+static void encode_tuned(const tuning_t *t, uint8_t *block, size_t n,
+                         uint8_t *dst, size_t cap, uint64_t *size) {
+  lzw_max_key = t->max_key;
+  reset_when_full = t->reset_when_full;
+  do_ratio = t->do_ratio;
+  lzw_input_file = fmemopen(block, n, "r");
+  lzw_output_file = fmemopen(dst, cap, "w");
+  encode_stream();
+  fflush(lzw_output_file);
+  if (!ferror(lzw_output_file)) {
+    *size = ftell(lzw_output_file);
+  }
+}
+
+void encode_auto() {
+  FILE *in = lzw_input_file;
+  FILE *out = lzw_output_file;
+  uint8_t *block = malloc(auto_block_size);
+  assert(block);
+  // Each code covers at least a byte, and is at most 17 bits.
+  const size_t cap = 3 * auto_block_size + 4096;
+  uint64_t *sizes =
+      mmap(NULL, TUNING_COUNT * (sizeof(uint64_t) + cap),
+           PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  assert(sizes != MAP_FAILED);
+  uint8_t *outputs = (uint8_t *)(sizes + TUNING_COUNT);
+
+  uint64_t read = 0;
+  uint64_t written = 0;
+  size_t n;
+  for (int block_count = 0;
+       (n = fread(block, 1, auto_block_size, in)) > 0; block_count++) {
+    pid_t pids[TUNING_COUNT];
+    for (int k = 0; k < TUNING_COUNT; k++) {
+      sizes[k] = UINT64_MAX;
+      pids[k] = fork();
+      assert(pids[k] >= 0);
+      if (pids[k] == 0) {
+        encode_tuned(&tunings[k], block, n, outputs + k * cap, cap, &sizes[k]);
+        _exit(0);
+      }
+    }
+    int best = -1;
+    for (int k = 0; k < TUNING_COUNT; k++) {
+      int status;
+      waitpid(pids[k], &status, 0);
+      if (WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+          sizes[k] != UINT64_MAX && (best < 0 || sizes[k] < sizes[best])) {
+        best = k;
+      }
+    }
+    assert(best >= 0);
+
+    const tuning_t *t = &tunings[best];
+    uint8_t header[TUNING_HEADER_SIZE];
+    put_u32(header, t->max_key);
+    header[4] = t->reset_when_full | t->do_ratio << 1;
+    put_u32(header + 5, sizes[best]);
+    fwrite(header, 1, sizeof(header), out);
+    fwrite(outputs + best * cap, 1, sizes[best], out);
+    read += n;
+    written += sizeof(header) + sizes[best];
+    if (verbosity) {
+      fprintf(stderr, "block %d: max key %u%s%s, %zu -> %lu\n", block_count,
+              t->max_key, t->reset_when_full ? ", reset when full" : "",
+              t->do_ratio ? ", ratio resets" : "", n, sizes[best]);
+    }
+  }
+  total_stream_read = read;
+  total_stream_written = written;
+  lzw_input_file = in;
+  lzw_output_file = out;
+  munmap(sizes, TUNING_COUNT * (sizeof(uint64_t) + cap));
+  free(block);
+}
+
+// Hands the decoder one block's worth of the stream, so a block is
+// never buffered whole and its length is only as good as the input.
+typedef struct {
+  FILE *in;
+  uint32_t left;
+} block_reader_t;
+
+static ssize_t block_read(void *cookie, char *buffer, size_t size) {
+  block_reader_t *r = cookie;
+  const size_t n = fread(buffer, 1, size < r->left ? size : r->left, r->in);
+  r->left -= n;
+  return n;
+}
+
+// The decoder only needs the max key; the resets are in the stream.
+// The output limit is for the whole stream, so each block gets what's left.
+bool decode_auto() {
+  FILE *in = lzw_input_file;
+  const uint64_t max_output = lzw_max_output;
+  uint64_t written = 0;
+  bool ok = true;
+  while (ok) {
+    uint8_t header[TUNING_HEADER_SIZE];
+    const size_t got = fread(header, 1, sizeof(header), in);
+    if (got == 0) {
+      break;
+    }
+    block_reader_t block = {.in = in, .left = get_u32(header + 5)};
+    if (got < sizeof(header) || !block.left) {
+      fprintf(stderr, "Error, truncated auto-tuned block\n");
+      ok = false;
+      break;
+    }
+    lzw_max_key = get_u32(header);
+    if (lzw_max_key < 256) {
+      fprintf(stderr, "Error, auto-tuned block has a bad max key (%u)\n",
+              lzw_max_key);
+      ok = false;
+      break;
+    }
+    if (max_output) {
+      if (written >= max_output) {
+        fprintf(stderr, "Error, %s, after %lu bytes\n",
+                decode_status_message(LZW_DECODE_OUTPUT_LIMIT), written);
+        ok = false;
+        break;
+      }
+      lzw_max_output = max_output - written;
+    }
+    lzw_input_file = fopencookie(&block, "r", (cookie_io_functions_t){
+                                                   .read = block_read});
+    decoded_before = written;
+    ok = decode_stream();
+    written += total_stream_written;
+    // Whatever the decoder left of the block must still be there.
+    char rest[4096];
+    while (ok && block.left && block_read(&block, rest, sizeof(rest)) > 0) {
+    }
+    fclose(lzw_input_file);
+    if (ok && block.left) {
+      fprintf(stderr, "Error, truncated auto-tuned block\n");
+      ok = false;
+    }
+  }
+  total_stream_written = written;
+  lzw_input_file = in;
+  lzw_max_output = max_output;
+  decoded_before = 0;
+  return ok;
+}
+
+// process_stream consumes all the globally-set parameters, and returns
+// false if the input couldn't be decoded.
+bool process_stream() {
+  if (auto_block_size) {
+    if (do_decode) {
+      return decode_auto();
+    }
+    encode_auto();
+  } else if (do_decode) {
+    return decode_stream();
   } else {
     encode_stream();
   }
+  return true;
 }
 
 // This is a shared correctness routine/helper
@@ -170,11 +497,162 @@ void round_trip() {
   do_encode = false;
   do_decode = true;
   fprintf(stderr, "Decoding stream\n");
-  process_stream();
+  if (!process_stream()) {
+    exit(1);
+  }
 
   fclose(intermediate);
 }
 
+// Streaming verification: we encode the input to the output as usual,
+// while also decoding what we wrote and comparing that with the input.
+// The stages are forked processes (the library's state is global), so
+// they run concurrently, connected by pipes:
+//   encoder -> tee (to the output) -> decoder -> us (comparing)
+// Nothing holds more than a pipe's worth of data, whatever the input
+// size. We compare by rereading the input with pread, so it has to be
+// a regular file.
+static pid_t verify_fork(void) {
+  fflush(NULL);
+  const pid_t pid = fork();
+  assert(pid >= 0);
+  return pid;
+}
+
+static void verify_pipe(int fds[2]) {
+  if (pipe(fds)) {
+    perror("Error, can't make a pipe");
+    exit(1);
+  }
+}
+
+// The archive is what we're vouching for, so any failure to write all
+// of it (including on close) fails the tee stage, and with it -V.
+static bool verify_tee(int from, FILE *archive, FILE *decoder) {
+  uint8_t buffer[1 << 16];
+  bool archived = true;
+  ssize_t n;
+  while ((n = read(from, buffer, sizeof(buffer))) > 0) {
+    archived &= fwrite(buffer, 1, n, archive) == n;
+    fwrite(buffer, 1, n, decoder);
+  }
+  archived &= n == 0 && fflush(archive) == 0 && !ferror(archive);
+  fclose(decoder);
+  return (fclose(archive) == 0) & archived;
+}
+
+// Returns the offset of the first byte that differs (or is missing on
+// either side), or UINT64_MAX if everything matched.
+static uint64_t verify_compare(int decoded, int original, uint64_t start,
+                               uint64_t *length) {
+  static uint8_t got[1 << 16];
+  static uint8_t want[1 << 16];
+  uint64_t offset = 0;
+  ssize_t n;
+  while ((n = read(decoded, got, sizeof(got))) > 0) {
+    const ssize_t m = pread(original, want, n, start + offset);
+    const size_t both = m > 0 ? m : 0;
+    if (memcmp(got, want, both)) {
+      for (size_t i = 0; i < both; i++) {
+        if (got[i] != want[i]) {
+          return offset + i;
+        }
+      }
+    }
+    if (m < n) {
+      return offset + both;
+    }
+    offset += n;
+  }
+  *length = offset;
+  return pread(original, want, 1, start + offset) > 0 ? offset : UINT64_MAX;
+}
+
+static bool verify_exited(pid_t pid, const char *stage, bool report) {
+  int status;
+  waitpid(pid, &status, 0);
+  if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+    return true;
+  }
+  if (report) {
+    fprintf(stderr, "Error, the %s stage failed\n", stage);
+  }
+  return false;
+}
+
+bool verify_stream() {
+  struct stat st;
+  const int original = fileno(user_input);
+  if (original < 0 || fstat(original, &st) || !S_ISREG(st.st_mode)) {
+    fprintf(stderr, "Error, verifying rereads the input, so it has to be a "
+                    "regular file (-V)\n");
+    return false;
+  }
+  const uint64_t start = ftell(user_input);
+
+  int encoded[2];
+  int teed[2];
+  int decoded[2];
+  verify_pipe(encoded);
+  const pid_t encoder = verify_fork();
+  if (encoder == 0) {
+    close(encoded[0]);
+    do_encode = true;
+    lzw_output_file = fdopen(encoded[1], "w");
+    process_stream();
+    _exit(fclose(lzw_output_file) == 0 ? 0 : 1);
+  }
+  close(encoded[1]);
+
+  verify_pipe(teed);
+  const pid_t tee = verify_fork();
+  if (tee == 0) {
+    close(teed[0]);
+    if (!verify_tee(encoded[0], user_output, fdopen(teed[1], "w"))) {
+      perror("Error, can't write the archive");
+      _exit(1);
+    }
+    _exit(0);
+  }
+  close(encoded[0]);
+  close(teed[1]);
+
+  verify_pipe(decoded);
+  const pid_t decoder = verify_fork();
+  if (decoder == 0) {
+    close(decoded[0]);
+    do_encode = false;
+    do_decode = true;
+    lzw_input_file = fdopen(teed[0], "r");
+    lzw_output_file = fdopen(decoded[1], "w");
+    const bool decoded_ok = process_stream();
+    _exit(fclose(lzw_output_file) == 0 && decoded_ok ? 0 : 1);
+  }
+  close(teed[0]);
+  close(decoded[1]);
+
+  uint64_t length = 0;
+  const uint64_t mismatch =
+      verify_compare(decoded[0], original, start, &length);
+  close(decoded[0]);
+  const bool matched = mismatch == UINT64_MAX;
+  if (!matched) {
+    fprintf(stderr, "Error, the round trip differs from the input at byte %lu\n",
+            mismatch);
+    kill(encoder, SIGTERM);
+    kill(tee, SIGTERM);
+    kill(decoder, SIGTERM);
+  }
+  // We reap every stage, but only blame one if the output matched.
+  const bool ok = verify_exited(encoder, "encoder", matched) &
+                  verify_exited(tee, "tee", matched) &
+                  verify_exited(decoder, "decoder", matched);
+  if (ok && matched) {
+    fprintf(stderr, "Verified %lu bytes\n", length);
+  }
+  return ok && matched;
+}
+
 void dumpbytes(const char *d, size_t c) {
   for (size_t i = 0; i < c; i++) {
     if (i > 0 && i % 20 == 0) {
@@ -185,14 +663,46 @@ void dumpbytes(const char *d, size_t c) {
   fprintf(stderr, "\n");
 }
 
+// The flush timer (-f) flushes whenever the input stalls, which can be
+// in the middle of a string, unlike -F. To get that in memory, we feed
+// the encoder through a pipe this much at a time, pausing in between.
+size_t trickle_bytes = 0;
+
+static FILE *trickle(const char *Data, size_t Size, pid_t *writer) {
+  int fds[2];
+  verify_pipe(fds);
+  *writer = verify_fork();
+  if (*writer == 0) {
+    close(fds[0]);
+    for (size_t i = 0; i < Size; i += trickle_bytes) {
+      const size_t n = Size - i < trickle_bytes ? Size - i : trickle_bytes;
+      if (write(fds[1], Data + i, n) != n) {
+        _exit(1);
+      }
+      usleep(2 * 1000 * lzw_flush_timeout_ms);
+    }
+    _exit(0);
+  }
+  close(fds[1]);
+  return fdopen(fds[0], "r");
+}
+
 void round_trip_in_memory(const char *Data, size_t Size) {
   char *encodechunks = NULL;
   size_t encodechunks_size = 0;
   init_streams((char *)Data, Size, &encodechunks, &encodechunks_size);
+  pid_t writer = 0;
+  if (trickle_bytes) {
+    fclose(lzw_input_file);
+    lzw_input_file = trickle(Data, Size, &writer);
+  }
   do_encode = true;
   do_decode = false;
   process_stream();
   close_streams();
+  if (writer && !verify_exited(writer, "trickle", true)) {
+    abort();
+  }
   assert(total_stream_read == Size);
   assert(total_stream_written == encodechunks_size);
 
@@ -202,7 +712,9 @@ void round_trip_in_memory(const char *Data, size_t Size) {
                &decodechunks_size);
   do_encode = false;
   do_decode = true;
-  process_stream();
+  if (!process_stream()) {
+    abort();
+  }
   close_streams();
   // assert(total_stream_read == encodechunks_size); // because of clear-codes, this isn't quite true.
   assert(total_stream_written == decodechunks_size); // We can compute this by summing decode return values.
@@ -214,7 +726,38 @@ void round_trip_in_memory(const char *Data, size_t Size) {
   free(decodechunks);
 }
 
-#ifdef FUZZ_MODE
+#if defined(FUZZ_MODE) && defined(FUZZ_DECODE)
+// Decoding what anyone could hand us: the first bytes pick the format,
+// and the rest goes straight to the decoder, with limits set so that no
+// stream can run away with the output or the dictionary.
+int LLVMFuzzerTestOneInput(const uint8_t *Data, size_t Size) {
+  if (Size < 3) {
+    return 0;
+  }
+  // Auto-tuned blocks and .Z streams carry their own settings.
+  auto_block_size = Data[0] & 1;
+  lzw_compress_bits = !auto_block_size && Data[0] & 2 ? 16 : 0;
+  const bool plain = !auto_block_size && !lzw_compress_bits;
+  lzw_sync = plain && Data[0] & 4;
+  lzw_evict = plain && Data[0] & 8;
+  lzw_max_key = plain && Data[1] ? 512u << (Data[1] % 8) : 0;
+  lzw_max_dictionary_bytes = plain ? (uint64_t)Data[2] << 12 : 0;
+  lzw_max_output = 1 << 24;
+  lzw_max_expansion = 1 << 10;
+  lzw_max_decode_bytes = 1 << 26;
+  page_size = 4096;
+
+  char *decoded = NULL;
+  size_t decoded_size = 0;
+  init_streams((char *)Data + 3, Size - 3, &decoded, &decoded_size);
+  do_encode = false;
+  do_decode = true;
+  process_stream();
+  close_streams();
+  free(decoded);
+  return 0;
+}
+#elif defined(FUZZ_MODE)
 int LLVMFuzzerTestOneInput(const uint8_t *Data, size_t Size) {
   if (Size < 12) { // just reserve enough bytes.
     return 0;
@@ -229,6 +772,28 @@ int LLVMFuzzerTestOneInput(const uint8_t *Data, size_t Size) {
     return 0;
   }
   do_ratio = (Data[9] % 2) == 0;
+  // Data[8] picks the dictionary's limits and the stream's flushes, and
+  // otherwise how far flexible parsing looks, which combines with neither.
+  const uint8_t modes = Data[8];
+  lzw_evict = modes & 1;
+  lzw_sync = modes & 2;
+  // Data[9] says how often to flush: every so many bytes, or on a timer
+  // while we trickle the input in that many bytes at a time.
+  const size_t every = 1 + (Data[9] >> 2) * 64;
+  const bool timer = lzw_sync && Data[9] & 2;
+  flush_bytes = lzw_sync && !timer ? every : 0;
+  if (flush_bytes && flush_bytes < page_size) {
+    page_size = flush_bytes;
+  }
+  lzw_flush_timeout_ms = timer;
+  // Every pause costs us, so only so many of them.
+  const size_t pauses = 64;
+  trickle_bytes = 0;
+  if (timer) {
+    trickle_bytes = every * pauses > Size - 10 ? every : (Size - 10) / pauses;
+  }
+  lzw_max_dictionary_bytes = modes & 4 ? (1 + (modes >> 3)) << 12 : 0;
+  lzw_flexible = modes & 7 ? 0 : modes >> 3;
   //fprintf(stderr, "page_size=%zu\tlzw_max_key=%u\tdo_ratio=%d\n", page_size, lzw_max_key, do_ratio);
   round_trip_in_memory((const char *)Data+10, Size-10);
   return 0;
@@ -238,11 +803,16 @@ int main(int argc, char *argv[]) {
   char c;
   bool correctness_roundtrip = false;
   bool correctness_roundtrip_memory = false;
+  bool batch = false;
+  bool verify = false;
+  int status = 0;
+  char *trace_filename = NULL;
+  uint64_t trace_events = 1 << 20;
 
   user_input = stdin;
   user_output = stdout;
 
-  while ((c = getopt(argc, argv, "deg:m:p:r:q:l:v:xcCb:i:o:")) != -1) {
+  while ((c = getopt(argc, argv, "deg:m:M:EHURp:r:q:l:v:xcCVb:Bi:o:sf:F:Z:A:T:t:L:O:X:D:")) != -1) {
     switch (c) {
     case 'd':
       do_decode = true;
@@ -256,6 +826,21 @@ int main(int argc, char *argv[]) {
     case 'm':
       lzw_max_key = atoi(optarg);
       break;
+    case 'M':
+      lzw_max_dictionary_bytes = strtoull(optarg, NULL, 0);
+      break;
+    case 'R':
+      reset_when_full = true;
+      break;
+    case 'E':
+      lzw_evict = true;
+      break;
+    case 'H':
+      lzw_huge_pages = true;
+      break;
+    case 'U':
+      lzw_io_uring = true;
+      break;
     case 'p':
       page_size = atoi(optarg);
       break;
@@ -278,6 +863,47 @@ int main(int argc, char *argv[]) {
     case 'C': // for "correctness"
       correctness_roundtrip_memory = true;
       break;
+    case 'V':
+      verify = true;
+      break;
+    case 's':
+      lzw_sync = true;
+      break;
+    case 'f':
+      lzw_sync = true;
+      lzw_flush_timeout_ms = atoi(optarg);
+      break;
+    case 'F':
+      lzw_sync = true;
+      flush_bytes = atoi(optarg);
+      break;
+    case 'Z':
+      lzw_compress_bits = atoi(optarg);
+      break;
+    case 'A':
+      auto_block_size = strtoull(optarg, NULL, 0);
+      break;
+    case 'B':
+      batch = true;
+      break;
+    case 'O':
+      lzw_max_output = strtoull(optarg, NULL, 0);
+      break;
+    case 'X':
+      lzw_max_expansion = atoi(optarg);
+      break;
+    case 'D':
+      lzw_max_decode_bytes = strtoull(optarg, NULL, 0);
+      break;
+    case 'L':
+      lzw_flexible = atoi(optarg);
+      break;
+    case 'T':
+      trace_filename = optarg;
+      break;
+    case 't':
+      trace_events = strtoull(optarg, NULL, 0);
+      break;
     case 'i':
       user_input = fopen(optarg, "r");
       assert(user_input);
@@ -291,8 +917,13 @@ int main(int argc, char *argv[]) {
     }
   }
 
-  if (correctness_roundtrip && correctness_roundtrip_memory) {
-    printf("Error, can't do both in-memory and through-file roundtrip (cC)\n");
+  if (correctness_roundtrip + correctness_roundtrip_memory + verify > 1) {
+    printf("Error, can only do one of the in-memory, through-file and "
+           "streaming roundtrips (cCV)\n");
+    return 2;
+  }
+  if (verify && (do_decode || batch)) {
+    printf("Error, verifying encodes a single stream (-V)\n");
     return 2;
   }
   if (lzw_max_key && lzw_max_key < 256) {
@@ -300,6 +931,60 @@ int main(int argc, char *argv[]) {
     return 2;
   }
 
+  if (batch && (do_decode || do_ratio || lzw_evict || reset_when_full ||
+                lzw_max_dictionary_bytes || flush_bytes ||
+                lzw_flush_timeout_ms)) {
+    printf("Error, batch mode only encodes, without clear codes, eviction "
+           "or flushes (-B)\n");
+    return 2;
+  }
+
+  if (lzw_compress_bits &&
+      (lzw_compress_bits < 10 || lzw_compress_bits > 16 || batch ||
+       lzw_max_key || lzw_max_dictionary_bytes || lzw_evict || lzw_sync)) {
+    printf("Error, compress mode takes 10-16 bits, without a max key, "
+           "eviction, flushes or batching (-Z)\n");
+    return 2;
+  }
+
+  if (auto_block_size &&
+      (batch || do_ratio || reset_when_full || lzw_max_key ||
+       lzw_max_dictionary_bytes || lzw_evict || lzw_sync || lzw_compress_bits)) {
+    printf("Error, auto-tuning picks the max key and resets itself, and "
+           "doesn't combine with other formats (-A)\n");
+    return 2;
+  }
+
+  if (lzw_flexible &&
+      (batch || lzw_max_dictionary_bytes || lzw_evict || lzw_sync)) {
+    printf("Error, flexible parsing needs whole keys for its cut-short "
+           "strings, so no byte budget, eviction, flushes or batching (-L)\n");
+    return 2;
+  }
+
+  if (trace_filename && auto_block_size) {
+    printf("Error, auto-tuning encodes in parallel processes, which can't "
+           "share a trace (-T)\n");
+    return 2;
+  }
+  if (trace_filename && verify) {
+    printf("Error, verifying encodes and decodes in separate processes, "
+           "which can't share a trace (-T)\n");
+    return 2;
+  }
+  if (trace_filename && !lzw_trace_open(trace_filename, trace_events)) {
+    printf("Error, can't map trace file %s\n", trace_filename);
+    return 2;
+  }
+
+  if (flush_bytes && flush_bytes < page_size) {
+    page_size = flush_bytes;
+  }
+
+  if (lzw_evict && !lzw_max_key && !lzw_max_dictionary_bytes) {
+    fprintf(stderr, "Warning, eviction (-E) does nothing without a max key\n");
+  }
+
   if (trace_ratio && !do_ratio) {
     fprintf(stderr,
             "Warning, do_ratio=%s, trace_ratio=%s, unexpected behavior\n",
@@ -308,13 +993,18 @@ int main(int argc, char *argv[]) {
 
   if (verbosity) {
     fprintf(stderr, "lzw_max_key: %d\n", lzw_max_key);
+    fprintf(stderr, "max bytes  : %lu\n", lzw_max_dictionary_bytes);
     fprintf(stderr, "page_size  : %zu\n", page_size);
   }
 
   lzw_input_file = user_input;
   lzw_output_file = user_output;
 
-  if (correctness_roundtrip) {
+  if (batch) {
+    encode_batch(argc - optind, argv + optind);
+  } else if (verify) {
+    status = verify_stream() ? 0 : 1;
+  } else if (correctness_roundtrip) {
     round_trip();
   } else if (correctness_roundtrip_memory) {
     char *inputbuffer = NULL;
@@ -334,9 +1024,25 @@ int main(int argc, char *argv[]) {
       printf("Error, must uniquely choose encode or decode\n");
       return 1;
     }
-    process_stream();
+    status = process_stream() ? 0 : 1;
   }
 
-  return 0;
+  if (verbosity) {
+    fprintf(stderr, "dictionary peak bytes: %lu\n",
+            lzw_dictionary_peak_bytes());
+  }
+  lzw_release_memory();
+  lzw_trace_close();
+  if (lzw_input_error()) {
+    fprintf(stderr, "Error, can't read the input: %s\n",
+            strerror(lzw_input_error()));
+    status = 1;
+  }
+  if (lzw_output_error()) {
+    fprintf(stderr, "Error, can't write the output: %s\n",
+            strerror(lzw_output_error()));
+    status = 1;
+  }
+  return status;
 }
 #endif
\ No newline at end of file
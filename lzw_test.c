@@ -41,14 +41,14 @@ void do_encode_stream() {
   total_stream_read = 0;
   total_stream_written = 0;
   fprintf(stderr, "ENCODING\n");
-  lzw_init();
+  lzw_encode_init();
   while (lzw_encode(page_size)) {
     if (!feof(lzw_input_file)) {
       lzw_write_clear_code();
       total_stream_read += lzw_bytes_read;
       total_stream_written += lzw_bytes_written;
       lzw_destroy_state();
-      lzw_init();
+      lzw_encode_init();
     }
   }
 
@@ -60,7 +60,7 @@ void do_decode_stream() {
   fprintf(stderr, "DECODING\n");
   total_stream_read = 0;
   total_stream_written = 0;
-  lzw_init();
+  lzw_decode_init();
   // Decode is guaranteed to make progress (even in presence of clear-codes)
   while (lzw_decode(page_size))
     ;
@@ -119,4 +119,5 @@ int main(int argc, char *argv[]) {
   free(encodechunks);
   free(decodechunks);
   free(Data);
+  lzw_release_memory();
 }
\ No newline at end of file
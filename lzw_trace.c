@@ -0,0 +1,204 @@
+#include "lzw.h"
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Renders a trace ring written by lzw_main -T, oldest event first, in the
+// same text as the debug build's -g output. The optional second argument
+// picks categories like -g does: s(tate), b(ytes), k(eys) and d(ictionary).
+// The per-byte state and byte events are only there if lzw_main was given
+// the same -g letters when it wrote the trace.
+//
+//   lzw_trace trace.bin [sbkd]
+
+static const char *asbits(uint64_t v, uint8_t l) {
+  static char format[(1 << 8 * sizeof(uint8_t)) + 1];
+  // Emit bits backwards
+  for (int i = 0; i < l; i++) {
+    format[l - (i + 1)] = v % 2 ? '1' : '0';
+    v >>= 1;
+  }
+  format[l] = '\0';
+  return format;
+}
+
+static bool show_state = true;
+static bool show_bytes = true;
+static bool show_keys = true;
+static bool show_dictionary = true;
+
+static void print_event(const lzw_trace_event_t *e) {
+  switch (e->kind) {
+  case LZW_TRACE_EMIT_KEY:
+    if (show_keys) {
+      printf("EMITKEY(%d):\t\t%d\t%s\n", e->width, e->key,
+             asbits(e->key, e->width));
+    }
+    break;
+  case LZW_TRACE_READ_KEY:
+    if (show_keys) {
+      printf("READKEY(%d):\t\t%d\t%s\n", e->width, e->key,
+             asbits(e->key, e->width));
+    }
+    break;
+  case LZW_TRACE_DICT_ADD:
+    if (show_dictionary) {
+      printf("DICT\tADD\t%u\t%u\t%u\t%#x\n", e->key, e->prefix, e->len, e->c);
+    }
+    break;
+  case LZW_TRACE_DICT_EVICT:
+    if (show_dictionary) {
+      printf("DICT\tEVICT\t%u\t%u\n", e->key, e->prefix);
+    }
+    break;
+  case LZW_TRACE_MAX_KEY:
+    if (show_state) {
+      printf("APPEND(%#x)\tMAXKEY\n", e->c);
+    }
+    break;
+  case LZW_TRACE_INC_LENGTH:
+    if (show_state) {
+      printf("INCLENGTH %d->%d\n", e->width, e->width + 1);
+    }
+    break;
+  case LZW_TRACE_CLEAR_CODE:
+    if (show_state) {
+      printf("CLEAR_CODE\t%lu\t%d\n", e->pos, e->c);
+    }
+    break;
+  case LZW_TRACE_SYNC_FLUSH:
+    if (show_state) {
+      printf("SYNC_FLUSH\t%lu\t%d\n", e->pos, e->c);
+    }
+    break;
+  case LZW_TRACE_ENCODE_END:
+    if (show_state) {
+      printf("ENCODE_END\t%u\t%lu\t%d\n", e->width, e->pos, e->c);
+    }
+    break;
+  case LZW_TRACE_DECODE_CLEAR:
+    if (show_state) {
+      printf("DECODE\tCLEAR_CODE\n");
+    }
+    break;
+  case LZW_TRACE_DECODE_FLUSH:
+    if (show_state) {
+      printf("DECODE\tFLUSH_CODE\n");
+    }
+    break;
+  case LZW_TRACE_STATE:
+    if (show_state) {
+      printf("APPEND(%#x)\t\tSTATE\t%u\t%u\n", e->c, e->prefix, e->key);
+    }
+    break;
+  case LZW_TRACE_NEW_STATE:
+    if (show_state) {
+      printf("APPEND(%#x)\t\tNEWSTATE %u\n", e->c, e->key);
+    }
+    break;
+  case LZW_TRACE_SHORT:
+    if (show_state) {
+      printf("APPEND(%#x)\tSHORT\t%u\n", e->c, e->key);
+    }
+    break;
+  case LZW_TRACE_FLUSH_TIMEOUT:
+    if (show_state) {
+      printf("FLUSH_TIMEOUT\n");
+    }
+    break;
+  case LZW_TRACE_ENCODE_EOF:
+    if (show_state) {
+      printf("lzw_encode:eof\n");
+    }
+    break;
+  case LZW_TRACE_DECODE_PEEK:
+    if (show_state) {
+      printf("DECODE(peek)\n");
+    }
+    break;
+  case LZW_TRACE_DECODE_BREAK:
+    if (show_state) {
+      printf("DECODE(break)\n");
+    }
+    break;
+  case LZW_TRACE_DECODE_CONTINUE:
+    if (show_state) {
+      printf("DECODE(continue)\n");
+    }
+    break;
+  case LZW_TRACE_ENCODE_READ_BYTE:
+  case LZW_TRACE_DECODE_READ_BYTE: {
+    const char *dir =
+        e->kind == LZW_TRACE_ENCODE_READ_BYTE ? "encode" : "decode";
+    if (show_bytes && e->key) {
+      printf("READBYTE(%s):\t%d\n", dir, EOF);
+    } else if (show_bytes) {
+      printf("READBYTE(%s):\t%#x\t%s\n", dir, e->c, asbits(e->c, 8));
+    }
+    break;
+  }
+  case LZW_TRACE_ENCODE_EMIT_BYTE:
+    if (show_bytes) {
+      printf("EMITBYTE(encode):\t%#x\t%s\n", e->c, asbits(e->c, 8));
+    }
+    break;
+  case LZW_TRACE_DECODE_EMIT_BYTE:
+    if (show_bytes) {
+      printf("EMITBYTE(decode):\t%#x\n", e->c);
+    }
+    break;
+  default:
+    printf("UNKNOWN(%d)\n", e->kind);
+    break;
+  }
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2 || argc > 3) {
+    fprintf(stderr, "Usage: %s trace [sbkd]\n", argv[0]);
+    return 2;
+  }
+  if (argc == 3) {
+    show_state = strchr(argv[2], 's') != NULL;
+    show_bytes = strchr(argv[2], 'b') != NULL;
+    show_keys = strchr(argv[2], 'k') != NULL;
+    show_dictionary = strchr(argv[2], 'd') != NULL;
+  }
+
+  const int fd = open(argv[1], O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) || st.st_size < sizeof(lzw_trace_header_t)) {
+    fprintf(stderr, "Error, can't read trace %s\n", argv[1]);
+    return 1;
+  }
+  const lzw_trace_header_t *header =
+      mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (header == MAP_FAILED ||
+      memcmp(header->magic, LZW_TRACE_MAGIC, sizeof(header->magic)) ||
+      header->version != LZW_TRACE_VERSION ||
+      header->event_size != sizeof(lzw_trace_event_t) || !header->capacity ||
+      header->capacity & (header->capacity - 1) ||
+      st.st_size < sizeof(*header) + header->capacity * header->event_size) {
+    fprintf(stderr, "Error, %s isn't an lzw trace\n", argv[1]);
+    return 1;
+  }
+
+  const lzw_trace_event_t *events = (const lzw_trace_event_t *)(header + 1);
+  const uint64_t mask = header->capacity - 1;
+  const uint64_t next = header->next;
+  const uint64_t first = next > header->capacity ? next - header->capacity : 0;
+  if (first) {
+    fprintf(stderr, "Warning, %lu older events were overwritten\n", first);
+  }
+  for (uint64_t i = first; i < next; i++) {
+    print_event(&events[i & mask]);
+  }
+  return 0;
+}